@@ -0,0 +1,123 @@
+"""Benchmarks of nim4py, 1 JSON object per line on stdout: python3 benchmarks/bench.py [nim_stdlib_path]
+--save baseline.json stores the medians, --baseline baseline.json fails if any is slower than --threshold."""
+import sys, os, json, time, array, shutil, tempfile, argparse, statistics
+import nim4py
+
+
+results = {}  # Median seconds per benchmark name, for --save and --baseline.
+
+
+def find_stdlib(stdlib):
+  if stdlib:
+    return stdlib
+  nim = shutil.which("nim")
+  assert nim, "Nim not found on PATH, pass the stdlib folder as argument"
+  return os.path.join(os.path.dirname(os.path.dirname(os.path.realpath(nim))), "lib")
+
+
+def bench(name, function, iterations = 10, repeat = 5):
+  timings = []
+  for _ in range(repeat):
+    start = time.perf_counter()
+    for _ in range(iterations):
+      function()
+    timings.append((time.perf_counter() - start) / iterations)
+  results[name] = statistics.median(timings)
+  print(json.dumps({"name": name, "iterations": iterations, "repeat": repeat,
+    "min": min(timings), "median": statistics.median(timings)}), flush = True)
+
+
+LOOPS = {
+  "vm_int_loop":     "var x = 0\nfor i in 0 ..< 1_000_000: x += i",
+  "vm_float_loop":   "var x = 0.0\nfor i in 0 ..< 1_000_000: x += float(i) * 0.5",
+  "vm_string_concat": "var s = \"\"\nfor i in 0 ..< 100_000: s.add 'x'",
+  "vm_seq_append":   "var s: seq[int]\nfor i in 0 ..< 100_000: s.add i",
+  "vm_table_ops":    "import tables\nvar t = initTable[int, int]()\nfor i in 0 ..< 10_000: t[i] = i\nfor i in 0 ..< 10_000: discard t[i]",
+}
+
+SCRIPT = """
+proc noop*() = discard
+proc fail*() = raise newException(ValueError, "bench")
+proc add*(a, b: int): int = a + b
+proc total*(values: seq[float]): float =
+  for value in values: result += value
+proc callback(x: int): int = discard
+proc roundtrip*(n: int): int =
+  for i in 0 ..< n: result += callback(i)
+"""
+
+
+def compare(baseline, threshold):
+  regressions = []
+  for name, median in sorted(results.items()):
+    if name in baseline and median > baseline[name] * (1 + threshold):
+      regressions.append(name)
+      print("REGRESSION: {} {:.6f}s, baseline {:.6f}s".format(name, median, baseline[name]), file = sys.stderr)
+  return regressions
+
+
+def main():
+  parser = argparse.ArgumentParser(description = __doc__)
+  parser.add_argument("stdlib", nargs = "?", help = "Nim stdlib folder, default is next to nim on PATH")
+  parser.add_argument("--save", help = "write the medians to this JSON file")
+  parser.add_argument("--baseline", help = "compare the medians to this JSON file of --save")
+  parser.add_argument("--threshold", type = float, default = 0.1, help = "allowed slowdown over the baseline, 0.1 is 10%%")
+  args = parser.parse_args()
+  stdlib = find_stdlib(args.stdlib)
+  folder = tempfile.mkdtemp()
+  script = os.path.join(folder, "bench.nims")
+  with open(script, "w") as source:
+    source.write(SCRIPT)
+
+  bench("nimscript", lambda: nim4py.nimscript(script, [stdlib]), iterations = 3)
+
+  def create():
+    interpreter = nim4py.Interpreter()
+    interpreter.init(script, [stdlib])
+    interpreter.eval()
+    interpreter.close()
+  bench("interpreter_create", create, iterations = 3)
+
+  interpreter = nim4py.Interpreter()
+  interpreter.init(script, [stdlib])
+  interpreter.register("bench.callback", lambda x: x)
+  interpreter.eval()
+  phases = interpreter.phases()
+  print(json.dumps({"name": "compile_phases", **phases}), flush = True)
+
+  for name, source in LOOPS.items():
+    bench(name, lambda: interpreter.eval_string(source), iterations = 1)
+  interpreter.eval_string(SCRIPT)  # eval_string replaces the main module, load the routines again.
+
+  noop = interpreter.routine("noop")
+  bench("call_overhead", lambda: interpreter.call("add", [1, 2]), iterations = 10_000)
+  bench("invoke_overhead", lambda: interpreter.invoke(noop), iterations = 10_000)
+
+  def error():
+    try:
+      interpreter.invoke(failing)
+    except Exception:
+      pass
+  failing = interpreter.routine("fail")
+  bench("error_overhead", error, iterations = 1_000)  # Compare to invoke_overhead, the success path.
+  bench("map_overhead", lambda: interpreter.map("add", [[1, 2]] * 10_000), iterations = 1)
+  bench("callback_roundtrip_1000", lambda: interpreter.call("roundtrip", [1000]), iterations = 10)
+
+  floats = [float(i) for i in range(1_000_000)]
+  bench("marshal_list_1m_floats", lambda: interpreter.call("total", [floats]), iterations = 1)
+  buffer = array.array("d", floats)
+  bench("marshal_buffer_1m_floats", lambda: interpreter.call("total", [buffer]), iterations = 1)
+  interpreter.close()
+  shutil.rmtree(folder)
+
+  if args.save:
+    with open(args.save, "w") as output:
+      json.dump(results, output, indent = 2)
+  if args.baseline:
+    with open(args.baseline) as baseline:
+      if compare(json.load(baseline), args.threshold):
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+  main()
@@ -0,0 +1,111 @@
+"""Same algorithms in CPython, in the nim4py VM and compiled to native code, 1 JSON object per line on stdout:
+python3 benchmarks/compare.py [nim_stdlib_path]. Each mode runs in its own process, so its peak RSS is its own."""
+import sys, os, json, time, shutil, ctypes, resource, tempfile, subprocess
+import nim4py
+
+
+SIZES = {"fib": 27, "series": 1_000_000, "strings": 200_000, "dict": 200_000, "roundtrip": 20_000}
+
+NIM = """
+import tables, json
+proc fib*(n: int): int{0} = (if n < 2: n else: fib(n - 1) + fib(n - 2))
+proc series*(n: int): int{0} =
+  var x = 0.0
+  for i in 0 ..< n: x += (if i mod 2 == 0: 1.0 else: -1.0) / float(2 * i + 1)
+  int(x * 1_000_000)
+proc strings*(n: int): int{0} =
+  var s = ""
+  for i in 0 ..< n: s.add $i
+  s.len
+proc dict*(n: int): int{0} =
+  var t = initTable[int, int]()
+  for i in 0 ..< n: t.mgetOrPut(i mod 1000, 0) += i
+  t.len
+proc roundtrip*(n: int): int{0} =
+  var items = newJArray()
+  for i in 0 ..< n: items.add %*{{"id": i, "name": "x" & $i}}
+  parseJson($items).len
+"""
+
+
+def fib(n):
+  return n if n < 2 else fib(n - 1) + fib(n - 2)
+
+def series(n):
+  x = 0.0
+  for i in range(n):
+    x += (1.0 if i % 2 == 0 else -1.0) / (2 * i + 1)
+  return int(x * 1_000_000)
+
+def strings(n):
+  s = ""
+  for i in range(n):
+    s += str(i)
+  return len(s)
+
+def dict_(n):
+  t = {}
+  for i in range(n):
+    t[i % 1000] = t.get(i % 1000, 0) + i
+  return len(t)
+
+def roundtrip(n):
+  return len(json.loads(json.dumps([{"id": i, "name": "x" + str(i)} for i in range(n)])))
+
+
+def find_stdlib():
+  if len(sys.argv) > 2:
+    return sys.argv[2]
+  nim = shutil.which("nim")
+  assert nim, "Nim not found on PATH, pass the stdlib folder as argument"
+  return os.path.join(os.path.dirname(os.path.dirname(os.path.realpath(nim))), "lib")
+
+
+def load(mode, folder):
+  """Functions of the mode by algorithm name, the time this takes is its startup."""
+  if mode == "python":
+    return {"fib": fib, "series": series, "strings": strings, "dict": dict_, "roundtrip": roundtrip}
+  if mode == "nim4py":
+    script = os.path.join(folder, "compare.nims")
+    with open(script, "w") as source:
+      source.write(NIM.format(""))
+    interpreter = nim4py.Interpreter()
+    interpreter.init(script, [find_stdlib()])
+    interpreter.eval()
+    return {name: (lambda name: lambda n: interpreter.call(name, [n]))(name) for name in SIZES}
+  source = os.path.join(folder, "compare.nim")
+  with open(source, "w") as output:
+    output.write(NIM.format(" {.exportc, dynlib, cdecl.}"))
+  library = ctypes.CDLL(nim4py.build_library(source, ["--threads:on"], os.path.join(folder, "cache")))
+  functions = {}
+  for name in SIZES:
+    function = getattr(library, name)
+    function.argtypes, function.restype = [ctypes.c_longlong], ctypes.c_longlong
+    functions[name] = function
+  return functions
+
+
+def worker(mode):
+  folder = tempfile.mkdtemp()
+  start = time.perf_counter()
+  functions = load(mode, folder)
+  result = {"mode": mode, "startup": time.perf_counter() - start}
+  for name, size in SIZES.items():
+    start = time.perf_counter()
+    functions[name](size)
+    result[name] = time.perf_counter() - start
+  result["max_rss_kb"] = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+  shutil.rmtree(folder)
+  print(json.dumps(result), flush = True)
+
+
+def main():
+  if len(sys.argv) > 1 and sys.argv[1] in ("python", "nim4py", "native"):
+    return worker(sys.argv[1])
+  stdlib = sys.argv[1:2]
+  for mode in ("python", "nim4py", "native"):
+    subprocess.check_call([sys.executable, __file__, mode] + stdlib)
+
+
+if __name__ == "__main__":
+  main()
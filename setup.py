@@ -1,4 +1,4 @@
-import os, sys, pathlib, setuptools, sysconfig, platform, importlib.metadata, atexit
+import os, sys, pathlib, setuptools, sysconfig, platform, importlib.metadata, atexit, subprocess, concurrent.futures
 from setuptools.command.build_ext import build_ext
 
 
@@ -25,21 +25,109 @@ for c_source_file in os.listdir(folder): # Walk the folder with C files.
     sources.append(str(pathlib.Path(folder) / c_source_file))
 
 
+pgo_mode = os.environ.get("NIM4PY_PGO", "")        # "generate" or "use", see the pgo command.
+pgo_dir = str(pathlib.Path("pgo-data").absolute()) # Profiles of the training run.
+portable = os.environ.get("NIM4PY_PORTABLE", "") == "1" # Compiler default ISA, the build runs on any CPU of the architecture.
+cpu_args = ["-mtune=generic"] if portable else ["-march=native", "-mtune=native"]
+compile_args = ["-flto", "-ffast-math"] + cpu_args + ["-O3", "-fsingle-precision-constant"]
+link_args = ["-s"]
+if pgo_mode == "generate":
+  compile_args.append("-fprofile-generate=" + pgo_dir)
+  link_args.append("-fprofile-generate=" + pgo_dir)
+elif pgo_mode == "use":
+  compile_args += ["-fprofile-use=" + pgo_dir, "-fprofile-correction", "-Wno-missing-profile"]
+
+
 class NoSuffixBuilder(build_ext):
   def get_ext_filename(self, ext_name): # NO Suffix
     filename = super().get_ext_filename(ext_name)
     return filename.replace(sysconfig.get_config_var('EXT_SUFFIX'), "") + pathlib.Path(filename).suffix
 
+  def build_extension(self, ext): # Compile the C files in parallel, setuptools compiles them 1 by 1.
+    compile = self.compiler.compile
+    jobs = int(os.environ.get("NIM4PY_JOBS", 0)) or os.cpu_count()
+    def parallel_compile(sources, *args, **kwargs):
+      with concurrent.futures.ThreadPoolExecutor(jobs) as pool:
+        return [obj for objs in pool.map(lambda source: compile([source], *args, **kwargs), sources) for obj in objs]
+    self.compiler.compile = parallel_compile
+    try:
+      super().build_extension(ext)
+    finally:
+      self.compiler.compile = compile
+
+
+class Benchmark(setuptools.Command):
+  description = "run the benchmarks, 1 JSON object per line on stdout"
+  user_options = [("nim-stdlib=", None, "Nim stdlib folder, default is next to nim on PATH"),
+                  ("save=", None, "write the medians to this JSON file"),
+                  ("baseline=", None, "fail if slower than the medians of this JSON file"),
+                  ("threshold=", None, "allowed slowdown over the baseline, default is 0.1")]
+
+  def initialize_options(self):
+    self.nim_stdlib = None
+    self.save = None
+    self.baseline = None
+    self.threshold = None
+
+  def finalize_options(self):
+    pass
+
+  def run(self):
+    bench = pathlib.Path(__file__).parent / "benchmarks" / "bench.py"
+    assert bench.is_file(), "ERROR: benchmarks/bench.py not found, run from the Git repo!."
+    options = [self.nim_stdlib] if self.nim_stdlib else []
+    for option in ("save", "baseline", "threshold"):
+      if getattr(self, option):
+        options += ["--" + option, str(getattr(self, option))]
+    subprocess.check_call([sys.executable, str(bench)] + options)
+
+
+class Compare(setuptools.Command):
+  description = "run the same algorithms in CPython, the nim4py VM and native code, 1 JSON object per mode"
+  user_options = [("nim-stdlib=", None, "Nim stdlib folder, default is next to nim on PATH")]
+
+  def initialize_options(self):
+    self.nim_stdlib = None
+
+  def finalize_options(self):
+    pass
+
+  def run(self):
+    compare = pathlib.Path(__file__).parent / "benchmarks" / "compare.py"
+    assert compare.is_file(), "ERROR: benchmarks/compare.py not found, run from the Git repo!."
+    subprocess.check_call([sys.executable, str(compare)] + ([self.nim_stdlib] if self.nim_stdlib else []))
+
+
+class ProfileGuidedBuild(setuptools.Command):
+  description = "build in place with profile-guided optimization, trained on the benchmarks"
+  user_options = [("nim-stdlib=", None, "Nim stdlib folder, default is next to nim on PATH"),
+                  ("bench=", None, "training script, default is benchmarks/bench.py")]
+
+  def initialize_options(self):
+    self.nim_stdlib = None
+    self.bench = None
+
+  def finalize_options(self):
+    self.bench = pathlib.Path(self.bench or pathlib.Path(__file__).parent / "benchmarks" / "bench.py")
+
+  def run(self):
+    assert self.bench.is_file(), "ERROR: benchmarks/bench.py not found, pass --bench=path/to/bench.py!."
+    build = [sys.executable, __file__, "build_ext", "--inplace", "--force"]
+    subprocess.check_call(build, env = {**os.environ, "NIM4PY_PGO": "generate"})
+    subprocess.check_call([sys.executable, str(self.bench)] + ([self.nim_stdlib] if self.nim_stdlib else []),
+      env = {**os.environ, "PYTHONPATH": os.getcwd()}, stdout = subprocess.DEVNULL)
+    subprocess.check_call(build, env = {**os.environ, "NIM4PY_PGO": "use"})
+
 
 setuptools.setup(
-  cmdclass = {"build_ext": NoSuffixBuilder},
+  cmdclass = {"build_ext": NoSuffixBuilder, "benchmark": Benchmark, "compare": Compare, "pgo": ProfileGuidedBuild},
   ext_modules = [
     setuptools.Extension(
       name = package_name,
       sources = sources,
       include_dirs = [folder],
-      extra_link_args = ["-s"],
-      extra_compile_args = ["-flto", "-ffast-math", "-march=native", "-mtune=native", "-O3", "-fsingle-precision-constant"],
+      extra_link_args = link_args,
+      extra_compile_args = compile_args,
     )
   ]
 )
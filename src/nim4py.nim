@@ -1,12 +1,1826 @@
 ## Nim for Python: A programming language embedded inside a programming language, installable via PIP.
-import compiler/nimeval, nimpy
+import std/[macros, dynlib, locks, tables, os, times, monotimes, osproc, sha1, strutils, streams, pegs, math], compiler/[nimeval, llstream, parser, astalgo, pathutils, ast, vmdef, vmhooks, lineinfos, options, msgs, modulegraphs, passes, modules, types], nimpy
+from compiler/sem import semPass
+from compiler/vm import evalPass, setGlobalValue
 
 
-proc nimscript(script: string; nim_stdlib_paths: seq[string]) {.exportpy.} =
+type Phase = enum ## Compiler phases timed by ``evalStream``.
+  phaseParse = "parse", phaseSem = "sem", phaseVm = "vm", phaseTotal = "total"
+
+type ImportRecord = tuple[module: string; self, cumulative: float; memory: int] ## Seconds and Nim heap bytes of 1 processed module.
+
+type Interpreter = ref object of PyNimObjectExperimental ## Persistent NimScript Interpreter for Python.
+  intr: nimeval.Interpreter
+  routines: seq[PSym] ## Resolved routines, the handles returned by ``routine``.
+  generation: int      ## Times ``routines`` was cleared, the high bits of each handle, so older handles are rejected.
+  releaseGil: bool     ## Release the Python GIL while the Nim compiler and VM run.
+  owner: int           ## Thread that created it, the Nim heap where its AST and VM live.
+  executor: PyObject   ## Background thread of the ``*_async`` methods, it owns the Interpreter.
+  asyncId: int         ## Key of the Interpreter owned by the background thread.
+  maxIterations: int   ## VM budget of backward jumps and calls per evaluation, ``0`` is the Nim default.
+  timeout: float       ## Wall-clock seconds per evaluation, ``0`` is no timeout.
+  hotReload: bool      ## Record the imported files after each evaluation, for ``reload``.
+  modified: Table[string, Time] ## Modification times of the imported files at the last evaluation.
+  profiling: bool      ## Record the time of each evaluation and call, for ``profile``.
+  samples: Table[string, float] ## Seconds per collapsed stack, ``script;routine``.
+  phaseTimes: array[Phase, float] ## Seconds per phase of the last evaluation.
+  imports: seq[ImportRecord] ## Modules processed by the last evaluation, for ``import_profile``.
+  replSem: PPassContext ## Open sem context of the main module kept across ``exec`` calls, ``nil`` until the first one.
+  replEval: PPassContext ## Open VM context of the main module kept across ``exec`` calls.
+  messages: seq[tuple[info: TLineInfo; message: string; severity: Severity]] ## Diagnostics of the last evaluation, never printed.
+  captureOutput: bool  ## Collect ``echo`` into ``output`` instead of writing it 1 line at a time.
+  diagnosticLine: bool ## The next line written is the diagnostic just recorded into ``messages``, it is dropped.
+  output: string       ## Captured output not yet read by ``read_output``.
+  maxMemory: int       ## Soft cap of the Nim heap in bytes after each evaluation, ``0`` is no cap.
+  deferGc: bool        ## No collection during evaluations, Python runs them with ``collect`` between calls.
+  collections: int     ## Full collections run by ``collect`` or the memory cap.
+  pauseTotal: float    ## Seconds spent in those collections.
+  pauseMax: float      ## Longest of those collections in seconds.
+  tracer: PyObject     ## Python callable getting each span as ``(name, start_ns, end_ns)``, ``nil`` is no tracing.
+  spans: seq[tuple[name: string; start, finish: int64]] ## Spans recorded without the GIL, not yet sent to ``tracer``.
+  shared: bool         ## Its graph and VM are in ``sharedGraphs``, other Interpreters of the thread use them too.
+  lineReaders: Table[int, File] ## Files opened by ``openLines`` of its scripts, by handle, closed by ``reset`` and ``close``.
+  lineReaderCounter: int ## Last handle given by ``openLines``.
+
+type Pool = ref object of PyNimObjectExperimental ## Process pool of warm NimScript Interpreters.
+  pool: PyObject       ## ``multiprocessing.Pool``, each worker process holds 1 warm Interpreter.
+
+
+type ForkServer = ref object of PyNimObjectExperimental ## Warm parent process, each request runs in a fresh ``fork()``.
+  interpreter: Interpreter ## Warmed once in the parent, the children get it copy-on-write.
+
+
+type Channel = ref object of PyNimObjectExperimental ## Shared memory message channel between Python and a running NimScript.
+  id: int              ## Slot in ``channels``, the number the NimScript passes to ``channelSend`` and ``channelRecv``.
+
+
+type Ring = object ## Lock-free single producer single consumer byte ring, length-prefixed messages.
+  head: int            ## Bytes read so far, only written by the consumer.
+  tail: int            ## Bytes written so far, only written by the producer.
+  size: int
+  data: ptr UncheckedArray[char]
+
+
+type ChannelRings = object ## Slot of 1 open ``Channel``, the rings are freed by the last of its users, the slot is reused.
+  inbox: Ring          ## To the NimScript.
+  outbox: Ring         ## From the NimScript.
+  users: int           ## The ``Channel`` plus each send or receive running on it, changed atomically, ``0`` is a free slot.
+  closed: bool         ## ``Channel.close`` was called, blocked sends and receives give up.
+
+
+type RequestError = object of CatchableError ## A ``ForkServer`` request failed in its child process.
+
+type TimeoutError = object of CatchableError ## NimScript exceeded its ``max_iterations`` or ``timeout``.
+
+type MemoryLimitError = object of CatchableError ## The Nim heap is over ``max_memory`` even after a full collection.
+
+type TypeError = object of CatchableError ## A value has no conversion to the Python or Nim type it must become.
+
+type Watchdog = tuple[iterations: ptr int; deadline: float; cancelled: ptr bool]
+
+
+const skippedTypes = {tyGenericInst, tyAlias, tySink, tyDistinct, tyRange, tyOrdinal, tyVar, tyLent, tyRef, tyPtr}
+
+
+var
+  nimLock: Lock ## The Nim compiler has process-wide state, only 1 thread may run it at a time.
+  pyEvalSaveThread: proc (): pointer {.cdecl, gcsafe.}
+  pyEvalRestoreThread: proc (state: pointer) {.cdecl, gcsafe.}
+  pyGILStateEnsure: proc (): cint {.cdecl, gcsafe.}
+  pyGILStateRelease: proc (state: cint) {.cdecl, gcsafe.}
+  pyUnicodeAsUtf8AndSize: proc (o: pointer; size: ptr int): cstring {.cdecl, gcsafe.} ## UTF-8 cached by CPython, not a copy.
+  pyListSize: proc (o: pointer): int {.cdecl, gcsafe.}
+  pyListGetItem: proc (o: pointer; i: int): pointer {.cdecl, gcsafe.} ## Borrowed reference.
+  pyErrClear: proc () {.cdecl, gcsafe.}
+  worker: Interpreter ## Warm Interpreter of a ``Pool`` worker process.
+  remoteCache: PyObject ## Backend of ``set_remote_cache``, shared by the nodes of a cluster, only used while holding the GIL.
+  asyncCounter: int   ## Last ``asyncId`` given, only changed while holding the GIL.
+  asyncWorkers {.threadvar.}: Table[int, Interpreter] ## Interpreters owned by ``*_async`` background threads.
+  resolvedPaths {.threadvar.}: Table[string, seq[string]] ## ``nim_stdlib_paths`` already resolved by ``resolvePaths``.
+  streamConsumer {.threadvar.}: PyObject ## Python callable of the running ``stream``, called by ``pyYield``.
+  nimRunning {.threadvar.}: bool ## This thread holds ``nimLock``, Python code it calls back must not enter nim4py again.
+  sharedGraphs {.threadvar.}: Table[string, nimeval.Interpreter] ## Warm graphs of ``init(..., shared=True)`` per stdlib paths.
+  environment {.threadvar.}: Table[string, string] ## Snapshot of the process environment read by ``os.getEnv`` in scripts.
+  environmentLoaded {.threadvar.}: bool ## ``environment`` was read once on this thread.
+  environmentSeen {.threadvar.}: int ## ``environmentChanges`` when ``environment`` was read, older means stale.
+  environmentChanges: int ## Bumped atomically by ``sync_environment``, ``putEnv`` and ``delEnv``, every thread reads again.
+  runningInterpreter {.threadvar.}: Interpreter ## Interpreter evaluating on this thread, the native helpers keep their state in it.
+  pegCache {.threadvar.}: Table[string, Peg] ## Patterns of the ``peg*`` builtins, compiled once per thread.
+  importStack {.threadvar.}: seq[tuple[module: string; start, children: float; memory: int]] ## Modules being processed, innermost last.
+  importRecords {.threadvar.}: seq[ImportRecord] ## Modules processed by the running evaluation, in the order they finished.
+  phaseSeconds: array[Phase, float] ## Accumulated by the timed passes, only changed while holding ``nimLock``.
+  phaseNested: float ## Seconds of the timed passes run inside the running one, like those of an imported module.
+  channels: array[64, ChannelRings] ## Slot of each open ``Channel``, never freed, so a stale id reads a free slot and not freed memory.
+  channelLock: Lock ## Guards publishing and freeing the rings of a slot, sends and receives never take it.
+
+initLock nimLock
+initLock channelLock
+let pythonLib = when defined(windows): loadLib("python3.dll") else: loadLib()
+if pythonLib != nil:
+  pyEvalSaveThread = cast[typeof(pyEvalSaveThread)](pythonLib.symAddr("PyEval_SaveThread"))
+  pyEvalRestoreThread = cast[typeof(pyEvalRestoreThread)](pythonLib.symAddr("PyEval_RestoreThread"))
+  pyGILStateEnsure = cast[typeof(pyGILStateEnsure)](pythonLib.symAddr("PyGILState_Ensure"))
+  pyGILStateRelease = cast[typeof(pyGILStateRelease)](pythonLib.symAddr("PyGILState_Release"))
+  pyUnicodeAsUtf8AndSize = cast[typeof(pyUnicodeAsUtf8AndSize)](pythonLib.symAddr("PyUnicode_AsUTF8AndSize"))
+  pyListSize = cast[typeof(pyListSize)](pythonLib.symAddr("PyList_Size"))
+  pyListGetItem = cast[typeof(pyListGetItem)](pythonLib.symAddr("PyList_GetItem"))
+  pyErrClear = cast[typeof(pyErrClear)](pythonLib.symAddr("PyErr_Clear"))
+
+
+template checkInterpreter(self: Interpreter) =
+  ## Raise unless ``self`` is initialized and used from its own thread, checked by -d:danger builds too.
+  if self.intr == nil: raise newException(ValueError, "Interpreter is not initialized, call init() first")
+  if self.owner != getThreadId(): raise newException(ValueError, "Interpreter must be used only from the Python thread that created it")
+
+
+template checkReentry() =
+  ## Raise inside a ``register`` callback or ``pyYield`` consumer, ``nimLock`` is not reentrant and would deadlock.
+  if nimRunning: raise newException(ValueError, "nim4py can not be called from a NimScript callback or pyYield consumer")
+
+
+template withoutGil(releaseGil: bool; body: untyped) =
+  ## Run ``body`` with the Python GIL released, ``body`` must not touch Python objects.
+  ## The Nim GC does not collect meanwhile, a collection runs the nimpy finalizers that decref ``PyObject`` garbage.
+  checkReentry()
+  let released = releaseGil and pyEvalSaveThread != nil and pyEvalRestoreThread != nil
+  if released: GC_disable()
+  let state = if released: pyEvalSaveThread() else: nil
+  acquire nimLock
+  nimRunning = true
+  try: body
+  finally:
+    nimRunning = false
+    release nimLock
+    if released:
+      pyEvalRestoreThread(state)
+      GC_enable()
+
+
+template measured(phase: Phase; body: untyped) =
+  ## Run ``body`` adding its time to ``phaseSeconds[phase]``, minus the timed passes it ran itself.
+  ## An ``import`` runs the passes of the imported module inside its own, so they count once, in their own phase.
+  let start = epochTime()
+  let outer = phaseNested
+  phaseNested = 0.0
+  try: body
+  finally:
+    let elapsed = epochTime() - start
+    phaseSeconds[phase] += elapsed - phaseNested
+    phaseNested = outer + elapsed
+
+
+template timed(pass: TPass; phase: Phase): TPass =
+  ## ``pass`` adding the time of each top-level statement to ``phaseSeconds[phase]``.
+  proc process(c: PPassContext; n: PNode): PNode {.nimcall, gensym.} =
+    measured(phase): result = pass.process(c, n)
+  proc close(graph: ModuleGraph; c: PPassContext; n: PNode): PNode {.nimcall, gensym.} =
+    measured(phase): result = pass.close(graph, c, n)
+  makePass(pass.open, process, close, pass.isFrontend)
+
+
+template imported(pass: TPass): TPass =
+  ## ``pass`` recording each module it processes into ``importRecords``, from opening to closing it.
+  ## That covers parsing, checking and running the module, the modules it imports are subtracted from its own time.
+  proc open(graph: ModuleGraph; module: PSym): PPassContext {.nimcall, gensym.} =
+    importStack.add (module.name.s, epochTime(), 0.0, getOccupiedMem())
+    result = pass.open(graph, module)
+  proc close(graph: ModuleGraph; c: PPassContext; n: PNode): PNode {.nimcall, gensym.} =
+    try: result = pass.close(graph, c, n)
+    finally:
+      let entry = importStack.pop
+      let cumulative = epochTime() - entry.start
+      if importStack.len > 0: importStack[^1].children += cumulative
+      importRecords.add (entry.module, cumulative - entry.children, cumulative, getOccupiedMem() - entry.memory)
+  makePass(open, pass.process, close, pass.isFrontend)
+
+
+proc resolvePaths(paths: seq[string]): seq[string] =
+  ## Absolute, existing and unique ``nim_stdlib_paths``, resolved once per thread.
+  ## Every missing or repeated folder is 1 ``stat`` less for each ``import`` the compiler resolves.
+  let key = paths.join("\0")
+  if key in resolvedPaths: return resolvedPaths[key]
+  for path in paths:
+    let folder = normalizedPath(absolutePath(expandTilde(path)))
+    if dirExists(folder) and folder notin result: result.add folder
+  assert result.len > 0, "nim_stdlib_paths has no existing folder: " & $paths
+  resolvedPaths[key] = result
+
+
+proc copyIn(ring: var Ring; position: int; source: pointer; length: int) =
+  let start = position mod ring.size
+  let first = min(length, ring.size - start)
+  if first > 0: copyMem(addr ring.data[start], source, first)
+  if first < length: copyMem(addr ring.data[0], cast[pointer](cast[int](source) + first), length - first)
+
+
+proc copyOut(ring: var Ring; position: int; target: pointer; length: int) =
+  let start = position mod ring.size
+  let first = min(length, ring.size - start)
+  if first > 0: copyMem(target, addr ring.data[start], first)
+  if first < length: copyMem(cast[pointer](cast[int](target) + first), addr ring.data[0], length - first)
+
+
+proc push(ring: var Ring; message: string): bool =
+  ## Append ``message``, ``false`` if the ring is full. Only the producer thread may call it.
+  let tail = ring.tail
+  let needed = sizeof(int) + message.len
+  if needed > ring.size: raise newException(ValueError, "Channel message bigger than its capacity: " & $message.len)
+  if ring.size - (tail - atomicLoadN(addr ring.head, ATOMIC_ACQUIRE)) < needed: return false
+  var length = message.len
+  ring.copyIn(tail, addr length, sizeof(int))
+  if length > 0: ring.copyIn(tail + sizeof(int), unsafeAddr message[0], length)
+  atomicStoreN(addr ring.tail, tail + needed, ATOMIC_RELEASE)
+  result = true
+
+
+proc pop(ring: var Ring; message: var string): bool =
+  ## Take the oldest message, ``false`` if the ring is empty. Only the consumer thread may call it.
+  let head = ring.head
+  if atomicLoadN(addr ring.tail, ATOMIC_ACQUIRE) == head: return false
+  var length: int
+  ring.copyOut(head, addr length, sizeof(int))
+  message.setLen length
+  if length > 0: ring.copyOut(head + sizeof(int), addr message[0], length)
+  atomicStoreN(addr ring.head, head + sizeof(int) + length, ATOMIC_RELEASE)
+  result = true
+
+
+proc releaseChannel(channel: ptr ChannelRings) =
+  ## Drop 1 user of ``channel``, the last one frees its rings and the slot can be published again.
+  if atomicSubFetch(addr channel.users, 1, ATOMIC_ACQ_REL) == 0:
+    withLock channelLock:
+      deallocShared channel.inbox.data
+      deallocShared channel.outbox.data
+      channel.inbox.data = nil # A free slot, ``init`` publishes it again.
+      channel.outbox.data = nil
+
+
+proc acquireChannel(id: int): ptr ChannelRings =
+  ## Shared memory of the open ``Channel`` ``id``, kept alive until ``releaseChannel``, ``nil`` if closed or unknown.
+  ## Lock-free, ``users`` only grows while it is not ``0``, so a slot whose rings are being freed is never taken.
+  if id notin 1 .. channels.high: return nil # Checked here, -d:danger builds have no index checks.
+  result = addr channels[id]
+  var users = atomicLoadN(addr result.users, ATOMIC_ACQUIRE)
+  while true:
+    if users == 0: return nil
+    if atomicCompareExchangeN(addr result.users, addr users, users + 1, true, ATOMIC_ACQ_REL, ATOMIC_ACQUIRE): break
+  if atomicLoadN(addr result.closed, ATOMIC_ACQUIRE):
+    releaseChannel(result)
+    result = nil
+
+
+template waitFor(ready: bool; idle: untyped) =
+  ## Spin on ``ready`` for a moment then run ``idle`` between checks, a busy channel never sleeps.
+  var spins = 0
+  while not ready:
+    if spins < 1000:
+      cpuRelax()
+      inc spins
+    else: idle
+
+
+proc toCharSet(n: PNode): set[char] =
+  ## ``set[char]`` of a VM ``nkCurly`` value.
+  for item in n:
+    if item.kind == nkRange: result.incl {char(item[0].intVal) .. char(item[1].intVal)}
+    else: result.incl char(item.intVal)
+
+
+proc vmArg[T](a: VmArgs; i: int): T =
+  ## Argument ``i`` of a VM callback as ``T``, the register getter is picked at compile time.
+  when T is string: getString(a, i)
+  elif T is bool: getBool(a, i)
+  elif T is SomeInteger or T is char or T is enum: T(getInt(a, i))
+  elif T is SomeFloat: T(getFloat(a, i))
+  else: {.error: "No VM argument conversion for this type".}
+
+
+macro vmCall(a: VmArgs; impl: typed): untyped =
+  ## Call the proc ``impl`` with each argument read by its declared type and set its result, unpacking code generated
+  ## per signature, like ``vmCall(a, proc (s: string; n: int): string = s.repeat(n))``.
+  let params = impl.getTypeImpl[0]
+  var call = newCall(impl)
+  var i = 0
+  for param in params[1 .. ^1]:
+    for _ in 0 ..< param.len - 2:
+      call.add newCall(nnkBracketExpr.newTree(bindSym"vmArg", param[^2]), a, newLit(i))
+      inc i
+  result = if params[0].kind == nnkEmpty: call else: newCall(bindSym"setResult", a, call)
+
+
+proc registerIntrinsics(intr: nimeval.Interpreter) =
+  ## Native ``strutils`` hot paths, the VM calls these instead of running their bodies as bytecode.
+  ## Float formatting runs at C speed too, for scripts that report many metrics, ``parseFloat`` already does in the VM.
+  ## A callback replaces every overload with that name, so each one checks which overload it got.
+  template intrinsic(name: string; body: untyped) {.dirty.} =
+    intr.implementRoutine("stdlib", "strutils", name, proc (a: VmArgs) {.closure, gcsafe.} = body)
+  template isChar(i: int): bool {.dirty.} = a.slots[a.rb + i + 1].kind == rkInt
+  intrinsic "replace":
+    if isChar(1): setResult(a, strutils.replace(getString(a, 0), char(getInt(a, 1)), char(getInt(a, 2))))
+    else: setResult(a, strutils.replace(getString(a, 0), getString(a, 1), getString(a, 2)))
+  intrinsic "split":
+    let sep = a.slots[a.rb + 2]
+    if sep.kind == rkInt: setResult(a, strutils.split(getString(a, 0), char(sep.intVal), int(getInt(a, 2))))
+    elif sep.node.kind == nkCurly: setResult(a, strutils.split(getString(a, 0), toCharSet(sep.node), int(getInt(a, 2))))
+    else: setResult(a, strutils.split(getString(a, 0), getString(a, 1), int(getInt(a, 2))))
+  intrinsic "strip":
+    setResult(a, strutils.strip(getString(a, 0), getBool(a, 1), getBool(a, 2), toCharSet(getNode(a, 3))))
+  intrinsic "startsWith":
+    if isChar(1): setResult(a, strutils.startsWith(getString(a, 0), char(getInt(a, 1))))
+    else: setResult(a, strutils.startsWith(getString(a, 0), getString(a, 1)))
+  intrinsic "endsWith":
+    if isChar(1): setResult(a, strutils.endsWith(getString(a, 0), char(getInt(a, 1))))
+    else: setResult(a, strutils.endsWith(getString(a, 0), getString(a, 1)))
+  intrinsic "toUpperAscii":
+    if isChar(0): setResult(a, BiggestInt(ord(strutils.toUpperAscii(char(getInt(a, 0))))))
+    else: setResult(a, strutils.toUpperAscii(getString(a, 0)))
+  intrinsic "toLowerAscii":
+    if isChar(0): setResult(a, BiggestInt(ord(strutils.toLowerAscii(char(getInt(a, 0))))))
+    else: setResult(a, strutils.toLowerAscii(getString(a, 0)))
+  intrinsic "repeat":
+    if isChar(0): setResult(a, strutils.repeat(char(getInt(a, 0)), int(getInt(a, 1))))
+    else: setResult(a, strutils.repeat(getString(a, 0), int(getInt(a, 1))))
+  intrinsic "cmpIgnoreCase": vmCall(a, proc (x, y: string): BiggestInt = strutils.cmpIgnoreCase(x, y))
+  intrinsic "cmpIgnoreStyle": vmCall(a, proc (x, y: string): BiggestInt = strutils.cmpIgnoreStyle(x, y))
+  for name in ["formatFloat", "formatBiggestFloat"]:
+    intrinsic name:
+      setResult(a, strutils.formatBiggestFloat(getFloat(a, 0), FloatFormatMode(getInt(a, 1)), int(getInt(a, 2)), char(getInt(a, 3))))
+
+
+proc watchdog(w: Watchdog) {.thread.} =
+  ## Exhaust the VM budget at the deadline, the VM already checks it on backward jumps and calls.
+  while not atomicLoadN(w.cancelled, ATOMIC_ACQUIRE):
+    if epochTime() >= w.deadline: atomicStoreN(w.iterations, 0, ATOMIC_RELEASE)
+    os.sleep 1
+
+
+template withGil(body: untyped) =
+  ## Run ``body`` holding the Python GIL, for Python code called back from inside ``withoutGil``.
+  let hasGil = pyGILStateEnsure != nil and pyGILStateRelease != nil
+  let state = if hasGil: pyGILStateEnsure() else: 0
+  try: body
+  finally:
+    if hasGil: pyGILStateRelease(state)
+
+
+template withLimits(self: Interpreter; body: untyped) =
+  ## Run ``body`` within the budget and timeout, a runaway script raises ``TimeoutError``.
+  ## The output goes to this Interpreter only, Interpreters sharing a graph keep it separate.
+  let vm = PCtx(self.intr.graph.vm)
+  let config = self.intr.graph.config
+  let errors = config.errorCounter # Never reset, the VM skips a statement when it differs from the count it saw last.
+  self.messages.setLen 0 # Only the diagnostics of the last evaluation are kept, a long-lived Interpreter does not pile them up.
+  self.intr.registerErrorHook(proc (config: ConfigRef; info: TLineInfo; message: string; severity: Severity) {.gcsafe.} =
+    self.messages.add (info, message, severity)
+    self.diagnosticLine = true) # msgs still formats it and writes it right after this hook.
+  self.diagnosticLine = false
+  config.writelnHook = proc (line: string) =
+    if self.diagnosticLine: self.diagnosticLine = false
+    elif self.captureOutput:
+      self.output.add line
+      self.output.add '\n'
+    else:
+      stdout.writeLine line
+      flushFile stdout
+  config.maxLoopIterationsVM = if self.maxIterations > 0: self.maxIterations else: 10_000_000
+  vm.loopIterations = config.maxLoopIterationsVM
+  var cancelled = false
+  var thread: Thread[Watchdog]
+  if self.timeout > 0: createThread(thread, watchdog, (addr vm.loopIterations, epochTime() + self.timeout, addr cancelled))
+  let previousInterpreter = runningInterpreter
+  runningInterpreter = self
+  if self.deferGc: GC_disable()
+  try:
+    body
+    if config.errorCounter > errors: # Checking goes on after an error, the statements with errors are not run.
+      var report: seq[string]
+      for entry in self.messages:
+        if entry.severity == Severity.Error: report.add toFileLineCol(config, entry.info) & ' ' & entry.message
+      raise newException(ValueError, "NimScript has " & $(config.errorCounter - errors) & " errors:\n" & report.join("\n"))
+  except ERecoverableError:
+    if vm.loopIterations <= 0: raise newException(TimeoutError, "NimScript exceeded max_iterations or timeout: " & getCurrentExceptionMsg())
+    raise
+  finally:
+    runningInterpreter = previousInterpreter
+    if self.deferGc: GC_enable()
+    if self.timeout > 0:
+      atomicStoreN(addr cancelled, true, ATOMIC_RELEASE)
+      joinThread thread
+
+
+proc epochNanos(): int64 =
+  let now = getTime()
+  result = now.toUnix * 1_000_000_000 + now.nanosecond
+
+
+template traced(self: Interpreter; name: string; body: untyped) =
+  ## Run ``body`` recording it as a span when a tracer is attached, without a tracer it is 1 ``nil`` check.
+  let spanStart = if self.tracer != nil: epochNanos() else: 0
+  try: body
+  finally:
+    if self.tracer != nil: self.spans.add (name, spanStart, epochNanos())
+
+
+template profiled(self: Interpreter; frame: string; body: untyped) =
+  ## Run ``body`` adding its wall-clock time to the collapsed stack ``script;frame`` when profiling, traced as ``frame``.
+  let start = if self.profiling: epochTime() else: 0.0
+  try: traced(self, frame): body
+  finally:
+    if self.profiling:
+      let stack = self.intr.scriptName & ';' & frame
+      self.samples[stack] = self.samples.getOrDefault(stack) + epochTime() - start
+
+
+proc toPython(n: PNode; typ: PType = nil): PyObject =
+  ## Convert a NimScript ``PNode`` value into a native Python object, the Nim type is used when known.
+  let py = pyBuiltinsModule()
+  let t = if typ != nil: typ.skipTypes(skippedTypes) else: nil
+  if n == nil or n.kind in {nkNilLit, nkEmpty}: return py.getAttr("None")
+  if t != nil and t.kind == tyBool: return py.callMethod("bool", n.intVal != 0)
+  if t != nil and t.kind == tyChar: return py.callMethod("chr", n.intVal)
+  case n.kind
+  of nkCharLit..nkUInt64Lit: result = py.callMethod("int", n.intVal)
+  of nkFloatLit..nkFloat128Lit: result = py.callMethod("float", n.floatVal)
+  of nkStrLit..nkTripleStrLit: result = py.callMethod("str", n.strVal)
+  of nkBracket, nkCurly:
+    let elementType = if t != nil and t.kind in {tySequence, tyArray, tyOpenArray, tyVarargs, tySet}: t.lastSon else: nil
+    let scalar = if n.kind == nkBracket and elementType != nil: elementType.skipTypes(skippedTypes).kind else: tyNone
+    if scalar in {tyInt..tyInt64, tyUInt..tyUInt64}: # Numeric seqs become a list in 1 call, not 1 append per item.
+      var values = newSeqOfCap[BiggestInt](n.len)
+      for item in n: values.add item.intVal
+      return py.callMethod("list", values)
+    if scalar in {tyFloat..tyFloat128}:
+      var values = newSeqOfCap[BiggestFloat](n.len)
+      for item in n: values.add item.floatVal
+      return py.callMethod("list", values)
+    result = py.callMethod("list")
+    for item in n:
+      if item.kind == nkRange:
+        for i in item[0].intVal .. item[1].intVal: discard result.callMethod("append", toPython(newIntNode(nkIntLit, i), elementType))
+      else: discard result.callMethod("append", toPython(item, elementType))
+    if n.kind == nkCurly: result = py.callMethod("set", result)
+  of nkPar, nkTupleConstr:
+    result = py.callMethod("list")
+    for i, item in n:
+      let itemType = if t != nil and t.kind == tyTuple and i < t.len: t[i] else: nil
+      discard result.callMethod("append", toPython(if item.kind == nkExprColonExpr: item[1] else: item, itemType))
+    result = py.callMethod("tuple", result)
+  of nkObjConstr:
+    result = py.callMethod("dict")
+    for i in 1 ..< n.len:
+      if n[i].kind == nkExprColonExpr and n[i][0].kind == nkSym:
+        discard result.callMethod("__setitem__", n[i][0].sym.name.s, toPython(n[i][1], n[i][0].sym.typ))
+  else: raise newException(TypeError, "NimScript value can not be converted to Python: " & $n.kind)
+
+
+proc bufferToNim(o: PyObject): PNode =
+  ## Convert a buffer (``memoryview``, ``array.array``, NumPy array) into a NimScript seq, flattened in C order.
+  ## The raw memory is copied once, the items are decoded on the Nim side without 1 Python object per item.
+  let view = pyBuiltinsModule().callMethod("memoryview", o)
+  let format = view.getAttr("format").to(string)
+  let itemsize = view.getAttr("itemsize").to(int)
+  let data = view.callMethod("tobytes").to(string)
+  result = newNode(nkBracket)
+  template decode(T: typedesc) =
+    let items = cast[ptr UncheckedArray[T]](data.cstring)
+    result.sons = newSeqOfCap[PNode](data.len div sizeof(T))
+    for i in 0 ..< data.len div sizeof(T):
+      when T is SomeFloat: result.sons.add newFloatNode(nkFloatLit, BiggestFloat(items[i]))
+      elif T is SomeSignedInt: result.sons.add newIntNode(nkIntLit, BiggestInt(items[i]))
+      else: result.sons.add newIntNode(nkIntLit, cast[BiggestInt](BiggestUInt(items[i])))
+  case (if format.len > 0: format[^1] else: '\0') # Skip the byte order prefix, the buffer is native.
+  of 'f': decode(float32)
+  of 'd': decode(float64)
+  of 'b', 'h', 'i', 'l', 'q', 'n':
+    case itemsize
+    of 1: decode(int8)
+    of 2: decode(int16)
+    of 4: decode(int32)
+    else: decode(int64)
+  of 'B', 'H', 'I', 'L', 'Q', 'N', 'c', '?':
+    case itemsize
+    of 1: decode(uint8)
+    of 2: decode(uint16)
+    of 4: decode(uint32)
+    else: decode(uint64)
+  else: raise newException(TypeError, "Buffer format can not be converted to NimScript: " & format)
+
+
+proc toNim(o: PyObject; typ: PType = nil): PNode
+
+
+let hasRawStrings = pyUnicodeAsUtf8AndSize != nil and pyListSize != nil and pyListGetItem != nil and pyErrClear != nil
+
+
+proc strToNim(raw: pointer): PNode =
+  ## ``nkStrLit`` copied once from the UTF-8 CPython caches in a ``str``, ``nil`` if ``raw`` is not a ``str``.
+  var size: int
+  let utf8 = pyUnicodeAsUtf8AndSize(raw, addr size)
+  if utf8 == nil:
+    pyErrClear()
+    return nil
+  result = newNode(nkStrLit)
+  result.strVal = newString(size)
+  if size > 0: copyMem(addr result.strVal[0], utf8, size)
+
+
+proc strListToNim(o: PyObject): PNode =
+  ## ``nkBracket`` of a ``list[str]``, sized once, without 1 ``PyObject`` per item.
+  let raw = cast[pointer](o.privateRawPyObj)
+  let size = pyListSize(raw)
+  result = newNode(nkBracket)
+  result.sons = newSeqOfCap[PNode](size)
+  for i in 0 ..< size:
+    let item = strToNim(pyListGetItem(raw, i))
+    if item == nil: return nil # Not only str, the generic path converts it.
+    result.sons.add item
+
+
+proc toObject(o: PyObject; t: PType; field: proc (o: PyObject; field: string): PyObject): PNode =
+  ## ``nkObjConstr`` of the object type ``t``, each field converted with its own Nim type as read by ``field``.
+  ## The fields come from the checked type, nothing of the Python object is reflected on but the field names.
+  if t.len > 0 and t[0] != nil: raise newException(TypeError, "Python value can not be converted to an inherited object: " & typeToString(t))
+  result = newNode(nkObjConstr)
+  result.typ = t
+  result.add newNode(nkEmpty)
+  result[0].typ = t
+  for item in t.n:
+    if item.kind != nkSym: raise newException(TypeError, "Python value can not be converted to an object variant: " & typeToString(t))
+    result.add newTree(nkExprColonExpr, newSymNode(item.sym), toNim(field(o, item.sym.name.s), item.sym.typ))
+
+
+proc toNim(o: PyObject; typ: PType = nil): PNode =
+  ## Convert a native Python object into a NimScript ``PNode`` value, the Nim type is used when known.
+  ## A ``dict`` becomes an object of the expected type, so ``json.loads`` output maps straight to Nim objects.
+  let t = if typ != nil: typ.skipTypes(skippedTypes) else: nil
+  let name = $o.getAttr("__class__").getAttr("__name__")
+  if t != nil and t.kind in {tyFloat..tyFloat128} and name == "int": return newFloatNode(nkFloatLit, o.to(BiggestFloat))
+  case name
+  of "bool": result = newIntNode(nkIntLit, BiggestInt(ord(o.to(bool))))
+  of "int": result = newIntNode(nkIntLit, o.to(BiggestInt))
+  of "float": result = newFloatNode(nkFloatLit, o.to(BiggestFloat))
+  of "str", "bytes":
+    if name == "str" and hasRawStrings:
+      result = strToNim(cast[pointer](o.privateRawPyObj))
+      if result != nil: return
+    var value = o.to(string)
+    result = newNode(nkStrLit)
+    shallowCopy(result.strVal, value) # Move the only copy into the node, payloads can be big.
+  of "NoneType": result = newNode(nkNilLit)
+  of "list", "tuple":
+    if name == "list" and hasRawStrings and t != nil and t.kind == tySequence and t.lastSon.skipTypes(skippedTypes).kind == tyString:
+      result = strListToNim(o)
+      if result != nil: return
+    let items = o.to(seq[PyObject])
+    if t != nil and t.kind == tyTuple:
+      result = newNode(nkTupleConstr)
+      for i, item in items: result.add toNim(item, if i < t.len: t[i] else: nil)
+    else:
+      let elementType = if t != nil and t.kind in {tySequence, tyArray, tyOpenArray, tyVarargs}: t.lastSon else: nil
+      result = newNode(nkBracket)
+      result.sons = newSeqOfCap[PNode](items.len) # Sized once from the list, not grown per item.
+      for item in items: result.sons.add toNim(item, elementType)
+  of "dict":
+    if t != nil and t.kind == tyObject and t.n != nil:
+      result = toObject(o, t, proc (o: PyObject; field: string): PyObject =
+        if not o.callMethod("__contains__", field).to(bool): raise newException(KeyError, "Missing field: " & field)
+        o.callMethod("__getitem__", field))
+    else: # Without a type, a dict is a seq of (key, value) tuples.
+      result = newNode(nkBracket)
+      for item in o.callMethod("items").to(seq[PyObject]):
+        let pair = item.to(seq[PyObject])
+        result.add newTree(nkTupleConstr, toNim(pair[0]), toNim(pair[1]))
+  of "memoryview", "array", "ndarray": result = bufferToNim(o)
+  of "Table", "RecordBatch": # Apache Arrow, 1 column per field of the expected object, column at a time.
+    let columns = pyBuiltinsModule().callMethod("dict")
+    for column in o.getAttr("column_names").to(seq[string]): discard columns.callMethod("__setitem__", column, o.callMethod("column", column))
+    result = toNim(columns, typ)
+  else:
+    if name.endsWith("Array") and pyBuiltinsModule().callMethod("hasattr", o, "to_numpy").to(bool): # Apache Arrow column, numeric buffers are not converted per item.
+      if $o.getAttr("type") in ["string", "large_string", "binary"]: result = toNim(o.callMethod("to_pylist"), typ)
+      elif name == "ChunkedArray": result = bufferToNim(o.callMethod("to_numpy"))
+      else: result = bufferToNim(o.callMethod("to_numpy", false))
+    elif t != nil and t.kind == tyObject and t.n != nil: # Dataclass, namedtuple or any instance, field by field from its attributes.
+      result = toObject(o, t, proc (o: PyObject; field: string): PyObject = o.getAttr(field))
+    else: raise newException(TypeError, "Python value can not be converted to NimScript: " & $o)
+
+
+proc toPython(a: VmArgs): seq[PyObject] =
+  ## Arguments of a VM callback as Python objects, read from the registers directly, not rendered to strings.
+  result = newSeqOfCap[PyObject](a.rc - 1)
+  for i in 0 ..< a.rc - 1:
+    let reg = a.slots[a.rb + i + 1]
+    case reg.kind
+    of rkInt: result.add toPython(newIntNode(nkIntLit, reg.intVal))
+    of rkFloat: result.add toPython(newFloatNode(nkFloatLit, reg.floatVal))
+    of rkNode: result.add toPython(reg.node)
+    else: result.add toPython(nil)
+
+
+proc compiledPeg(pattern: string): Peg =
+  ## ``pattern`` compiled once, later calls with the same pattern get the cached ``Peg``.
+  if pattern notin pegCache: pegCache[pattern] = peg(pattern)
+  result = pegCache[pattern]
+
+
+proc snapshot(): var Table[string, string] =
+  ## The environment as a hashed table, ``environ`` is scanned once per change and not per lookup.
+  ## The table is per thread, a change on any thread makes all of them scan again.
+  let changes = atomicLoadN(addr environmentChanges, ATOMIC_ACQUIRE)
+  if not environmentLoaded or environmentSeen != changes:
+    environment.clear()
+    for key, value in envPairs(): environment[key] = value
+    environmentLoaded = true
+    environmentSeen = changes
+  result = environment
+
+
+proc globMatch(name, pattern: string): bool =
+  ## ``name`` matches ``pattern`` where ``*`` is any run of characters and ``?`` any 1 character.
+  var i, j = 0
+  var star, resume = -1
+  while i < name.len:
+    if j < pattern.len and (pattern[j] == '?' or pattern[j] == name[i]):
+      inc i
+      inc j
+    elif j < pattern.len and pattern[j] == '*':
+      star = j
+      resume = i
+      inc j
+    elif star >= 0: # Let the last ``*`` take 1 more character.
+      j = star + 1
+      inc resume
+      i = resume
+    else: return false
+  while j < pattern.len and pattern[j] == '*': inc j
+  result = j == pattern.len
+
+
+proc privateTempDir(): string =
+  ## New folder in the temporary directory only the current user can enter, created by this call and by no one else,
+  ## so nothing another local user planted there (like a symlink) is followed by writes into it.
+  var attempt = 0
+  while true:
+    result = getTempDir() / "nim4py-" & $getCurrentProcessId() & '-' & $secureHash($getMonoTime().ticks & '-' & $attempt)
+    if not existsOrCreateDir(result): break # ``mkdir`` fails on any existing name, symlinks included.
+    inc attempt
+  setFilePermissions(result, {fpUserRead, fpUserWrite, fpUserExec})
+
+
+proc toStrings(n: PNode): seq[string] =
+  ## ``seq[string]`` of a VM ``nkBracket`` value.
+  for item in n: result.add item.strVal
+
+
+proc toFloats(n: PNode): seq[float] =
+  ## ``seq[float]`` of a VM ``nkBracket`` value, contiguous so the native loops over it vectorize.
+  result = newSeq[float](n.len)
+  for i, item in n: result[i] = if item.kind in {nkCharLit..nkUInt64Lit}: float(item.intVal) else: item.floatVal
+
+
+proc fromFloats(values: openArray[float]): PNode =
+  ## VM ``nkBracket`` value of ``values``, sized once.
+  result = newNode(nkBracket)
+  result.sons = newSeqOfCap[PNode](values.len)
+  for value in values: result.sons.add newFloatNode(nkFloatLit, value)
+
+
+proc registerBuiltins(intr: nimeval.Interpreter; capabilities: seq[string]) =
+  ## Native helpers for scripts, declared with a dummy body in a module named ``nim4py.nim``, see the README.
+  ## Procs of the same name in other modules keep their own bodies, only the ``nim4py`` module is replaced.
+  ## Helpers outside ``capabilities`` raise when called, the check is done here once and not per call.
+  template builtin(capability, name: string; body: untyped) {.dirty.} =
+    if capability.len == 0 or capability in capabilities: intr.implementRoutine("*", "nim4py", name, proc (a: VmArgs) {.closure, gcsafe.} = body)
+    else: intr.implementRoutine("*", "nim4py", name, proc (a: VmArgs) {.closure, gcsafe.} =
+      raise newException(ValueError, "NimScript capability not allowed: " & capability & " for " & name))
+  template osBuiltin(name: string; body: untyped) {.dirty.} = # The std/os procs themselves, scripts declare nothing.
+    if "env" in capabilities: intr.implementRoutine("stdlib", "os", name, proc (a: VmArgs) {.closure, gcsafe.} = {.gcsafe.}: body)
+    else: intr.implementRoutine("stdlib", "os", name, proc (a: VmArgs) {.closure, gcsafe.} =
+      raise newException(ValueError, "NimScript capability not allowed: env for " & name))
+  template emit(line: string) {.dirty.} = # To the output sink of the running Interpreter, see capture_output.
+    if intr.graph.config.writelnHook != nil: intr.graph.config.writelnHook(line)
+    else: stdout.writeLine line
+  builtin "", "pyYield": # proc pyYield*[T](value: T) = discard
+    {.gcsafe.}:
+      if streamConsumer == nil: raise newException(ValueError, "pyYield must run inside Interpreter.stream")
+      withGil: discard streamConsumer.callObject(toPython(a))
+  template blocked(channel: ptr ChannelRings; id: int) {.dirty.} = # Between checks of a full or empty ring.
+    if atomicLoadN(addr channel.closed, ATOMIC_ACQUIRE): raise newException(ValueError, "Channel is closed: " & $id)
+    if atomicLoadN(addr PCtx(intr.graph.vm).loopIterations, ATOMIC_ACQUIRE) <= 0: # Exhausted by the watchdog.
+      raise newException(TimeoutError, "NimScript exceeded max_iterations or timeout waiting on Channel: " & $id)
+    os.sleep 1
+  builtin "", "channelSend": # proc channelSend*(channel: int; message: string) = discard
+    {.gcsafe.}:
+      let message = getString(a, 1)
+      let id = int(getInt(a, 0))
+      let channel = acquireChannel(id)
+      if channel == nil: raise newException(ValueError, "Channel is closed or unknown: " & $id)
+      try:
+        waitFor(channel.outbox.push(message)): blocked(channel, id)
+      finally: releaseChannel(channel)
+  builtin "", "channelRecv": # proc channelRecv*(channel: int): string = discard
+    {.gcsafe.}:
+      let id = int(getInt(a, 0))
+      let channel = acquireChannel(id)
+      if channel == nil: raise newException(ValueError, "Channel is closed or unknown: " & $id)
+      var message: string
+      try:
+        waitFor(channel.inbox.pop(message)): blocked(channel, id)
+      finally: releaseChannel(channel)
+      setResult(a, message)
+  builtin "", "monoNanos": # proc monoNanos*(): int = discard
+    setResult(a, BiggestInt(getMonoTime().ticks))
+  builtin "", "pegMatch": # proc pegMatch*(s, pattern: string): bool = discard
+    {.gcsafe.}: vmCall(a, proc (s, pattern: string): bool = pegs.match(s, compiledPeg(pattern)))
+  builtin "", "pegFind": # proc pegFind*(s, pattern: string; start = 0): int = discard
+    {.gcsafe.}: vmCall(a, proc (s, pattern: string; start: int): BiggestInt = pegs.find(s, compiledPeg(pattern), start))
+  builtin "", "pegFindAll": # proc pegFindAll*(s, pattern: string): seq[string] = discard
+    {.gcsafe.}: vmCall(a, proc (s, pattern: string): seq[string] = pegs.findAll(s, compiledPeg(pattern)))
+  builtin "", "pegReplace": # proc pegReplace*(s, pattern, by: string): string = discard
+    {.gcsafe.}: vmCall(a, proc (s, pattern, by: string): string = pegs.replacef(s, compiledPeg(pattern), by))
+  template elementwise(name: string; operation: untyped) {.dirty.} = # proc vecAdd*(a, b: seq[float]): seq[float] = discard
+    builtin "", name:
+      let x = toFloats(getNode(a, 0))
+      let y = toFloats(getNode(a, 1))
+      if x.len != y.len: raise newException(ValueError, name & " needs seqs of the same length: " & $x.len & " and " & $y.len)
+      var values = newSeq[float](x.len)
+      for i in 0 ..< values.len: values[i] = operation(x[i], y[i])
+      setResult(a, fromFloats(values))
+  elementwise "vecAdd", `+`
+  elementwise "vecMul", `*`
+  elementwise "vecMin", min
+  elementwise "vecMax", max
+  template unary(name: string; operation: untyped) {.dirty.} = # proc vecSqrt*(values: seq[float]): seq[float] = discard
+    builtin "", name:
+      var values = toFloats(getNode(a, 0))
+      for value in values.mitems: value = operation(value)
+      setResult(a, fromFloats(values))
+  unary "vecSqrt", sqrt
+  unary "vecExp", exp
+  unary "vecLn", ln
+  unary "vecAbs", abs
+  builtin "", "vecPow": # proc vecPow*(values: seq[float]; exponent: float): seq[float] = discard
+    var values = toFloats(getNode(a, 0))
+    let exponent = getFloat(a, 1)
+    for value in values.mitems: value = pow(value, exponent)
+    setResult(a, fromFloats(values))
+  builtin "", "vecScale": # proc vecScale*(values: seq[float]; factor: float): seq[float] = discard
+    var values = toFloats(getNode(a, 0))
+    let factor = getFloat(a, 1)
+    for value in values.mitems: value *= factor
+    setResult(a, fromFloats(values))
+  builtin "", "vecDot": # proc vecDot*(a, b: seq[float]): float = discard
+    let x = toFloats(getNode(a, 0))
+    let y = toFloats(getNode(a, 1))
+    if x.len != y.len: raise newException(ValueError, "vecDot needs seqs of the same length: " & $x.len & " and " & $y.len)
+    var total = 0.0
+    for i in 0 ..< x.len: total += x[i] * y[i]
+    setResult(a, total)
+  builtin "", "vecSum": # proc vecSum*(values: seq[float]): float = discard
+    var total = 0.0
+    for value in toFloats(getNode(a, 0)): total += value
+    setResult(a, total)
+  osBuiltin "getEnv": setResult(a, snapshot().getOrDefault(getString(a, 0), getString(a, 1)))
+  osBuiltin "existsEnv": setResult(a, getString(a, 0) in snapshot())
+  osBuiltin "putEnv":
+    os.putEnv(getString(a, 0), getString(a, 1))
+    atomicInc environmentChanges
+  osBuiltin "delEnv":
+    os.delEnv(getString(a, 0))
+    atomicInc environmentChanges
+  builtin "fs", "statMany": # proc statMany*(paths: seq[string]): seq[int] = discard
+    let times = newNode(nkBracket)
+    for path in toStrings(getNode(a, 0)):
+      var time = -1'i64
+      try: time = getLastModificationTime(path).toUnix
+      except OSError: discard
+      times.add newIntNode(nkIntLit, time)
+    setResult(a, times)
+  builtin "fs", "walkFiles": # proc walkFiles*(dir: string): seq[string] = discard
+    var files: seq[string]
+    for path in walkDirRec(getString(a, 0)): files.add path
+    setResult(a, files)
+  builtin "fs", "globFiles": # proc globFiles*(dir, pattern: string): seq[string] = discard
+    let pattern = getString(a, 1)
+    var files: seq[string]
+    for path in walkDirRec(getString(a, 0)):
+      if globMatch(extractFilename(path), pattern): files.add path
+    setResult(a, files)
+  builtin "fs", "openLines": # proc openLines*(path: string): int = discard
+    {.gcsafe.}: # 1 MB buffer, lines are split natively, not by bytecode.
+      let owner = runningInterpreter
+      var file: File
+      if not open(file, getString(a, 0), fmRead, bufSize = 1 shl 20): raise newException(IOError, "Can not open: " & getString(a, 0))
+      inc owner.lineReaderCounter
+      owner.lineReaders[owner.lineReaderCounter] = file
+      setResult(a, BiggestInt(owner.lineReaderCounter))
+  builtin "fs", "readLines": # proc readLines*(handle: int; maxLines = 10_000): seq[string] = discard
+    {.gcsafe.}: # The next batch of lines, @[] at the end of the file.
+      let owner = runningInterpreter
+      let handle = int(getInt(a, 0))
+      if handle notin owner.lineReaders: raise newException(ValueError, "Line reader is closed: " & $handle)
+      let maxLines = int(getInt(a, 1))
+      var lines = newSeqOfCap[string](min(maxLines, 65_536))
+      var line: string
+      while lines.len < maxLines and owner.lineReaders[handle].readLine(line): lines.add line
+      setResult(a, lines)
+  builtin "fs", "closeLines": # proc closeLines*(handle: int) = discard
+    {.gcsafe.}:
+      var file: File
+      if runningInterpreter.lineReaders.pop(int(getInt(a, 0)), file): close file
+  builtin "exec", "execMany": # proc execMany*(commands: seq[string]; parallelism = 0): seq[int] = discard
+    let commands = toStrings(getNode(a, 0))
+    var codes = newSeq[int](commands.len)
+    var logs, shellCommands: seq[string]
+    let folder = privateTempDir()
+    for i, command in commands: # Each child writes to its own file, a full pipe can not block it.
+      logs.add folder / $i & ".log"
+      shellCommands.add "(" & command & ") > " & quoteShell(logs[i]) & " 2>&1" # All of a compound command, not its last part.
+    let parallelism = int(getInt(a, 1))
+    try:
+      discard execProcesses(shellCommands, {poEvalCommand, poUsePath}, if parallelism > 0: parallelism else: countProcessors(),
+        afterRunEvent = proc (i: int; process: Process) =
+          codes[i] = process.peekExitCode
+          for line in lines(logs[i]): emit line)
+    finally: removeDir folder
+    let results = newNode(nkBracket)
+    for code in codes: results.add newIntNode(nkIntLit, code)
+    setResult(a, results)
+  builtin "exec", "execStream": # proc execStream*(command: string): int = discard
+    let process = startProcess(getString(a, 0), options = {poEvalCommand, poStdErrToStdOut, poUsePath})
+    var line: string
+    while process.outputStream.readLine(line): emit line
+    setResult(a, BiggestInt(process.waitForExit))
+    process.close()
+
+
+proc nimscript(script: string; nim_stdlib_paths: seq[string]; release_gil = true) {.exportpy.} =
   ## NimScript Interpreter for Python, see https://nim-lang.github.io/Nim/nims.html
-  ## * ``func nimscript(script: string; nim_stdlib_paths: seq[string])``
+  ## * ``func nimscript(script: string; nim_stdlib_paths: seq[string]; release_gil = true)``
   assert script.len > 0, "NimScript must not be empty string"
   assert nim_stdlib_paths.len > 0, "nim_stdlib_paths must not be empty seq"
-  let interpreter = createInterpreter(script, nim_stdlib_paths)
-  interpreter.evalScript()
-  interpreter.destroyInterpreter()
+  withoutGil(release_gil):
+    let interpreter = createInterpreter(script, resolvePaths(nim_stdlib_paths))
+    interpreter.graph.config.errorMax = high(int) # Raise errors instead of quitting the Python process.
+    try:
+      interpreter.evalScript()
+      let errors = interpreter.graph.config.errorCounter # Counted only, the statements with errors were skipped.
+      if errors > 0: raise newException(ValueError, "NimScript has " & $errors & " errors: " & script)
+    finally: interpreter.destroyInterpreter()
+
+
+proc fingerprint(path: string): string =
+  ## Size, modification time and inode of ``path``, 1 ``stat`` that changes whenever its content may have.
+  let info = getFileInfo(path)
+  result = $info.size & ' ' & $info.lastWriteTime.toUnix & '.' & $info.lastWriteTime.nanosecond & ' ' & $info.id.file
+
+
+proc localImports(path: string; found: var seq[string]) =
+  ## ``path`` and the modules it imports or includes from local files, recursively, each one once.
+  ## Read from its ``import``, ``from`` and ``include`` statements, also those continued on the next lines
+  ## after a ``,`` or inside ``[]``, the stdlib and packages are left to the options.
+  if path in found: return
+  found.add path
+  var statement = ""
+  for line in lines(path):
+    let code = line.split('#', maxsplit = 1)[0].strip
+    if statement.len > 0: statement.add ' ' & code
+    elif code in ["import", "include"] or code.startsWith("import ") or code.startsWith("include ") or code.startsWith("from "): statement = code
+    else: continue
+    if statement in ["import", "include"] or statement.endsWith(',') or statement.count('[') > statement.count(']'): continue
+    let names = if statement.startsWith("from "): statement.splitWhitespace()[1] else: statement.split(' ', maxsplit = 1)[1]
+    statement = ""
+    var modules: seq[string]
+    var depth = 0
+    var item = ""
+    for c in names & ',': # Split at the commas outside ``[]``, ``std/[os, strutils]`` expands to 1 module each.
+      if c == ',' and depth == 0:
+        let bracket = item.find('[')
+        if bracket >= 0:
+          for name in item[bracket + 1 .. ^1].strip(chars = {']', ' '}).split(','): modules.add item[0 ..< bracket].strip & name.strip
+        else: modules.add item
+        item = ""
+      else:
+        if c == '[': inc depth
+        elif c == ']': dec depth
+        item.add c
+    for module in modules:
+      let name = module.split(" as ")[0].split(" except ")[0].strip(chars = Whitespace + {'"'})
+      let file = normalizedPath(parentDir(path) / name.addFileExt("nim"))
+      if name.len > 0 and fileExists(file): localImports(file, found)
+
+
+proc sourceDigest(path: string; options: seq[string]; cacheDir: string): string =
+  ## SHA1 of the source, its local imports and the options, rehashed only when a fingerprint saved in ``cacheDir`` changed.
+  ## The manifest holds 1 ``fingerprint<TAB>path`` line per hashed file, then the digest.
+  let manifest = cacheDir / (splitFile(path).name & '.' & $secureHash(absolutePath(path) & '\0' & options.join("\0")) & ".fingerprint")
+  if fileExists(manifest):
+    let saved = readFile(manifest).split('\n')
+    var fresh = saved.len >= 2
+    for entry in saved[0 .. ^2]:
+      let fields = entry.split('\t', maxsplit = 1)
+      if not fresh or fields.len != 2 or not fileExists(fields[1]) or fingerprint(fields[1]) != fields[0]:
+        fresh = false
+        break
+    if fresh: return saved[^1]
+  var files: seq[string]
+  localImports(absolutePath(path), files)
+  var content = options.join("\0")
+  var stamps: string
+  for file in files: # Contents only, not paths, so every node of a remote cache gets the same digest.
+    content.add '\0' & readFile(file)
+    stamps.add fingerprint(file) & '\t' & file & '\n'
+  result = $secureHash(content)
+  createDir(cacheDir)
+  writeFile(manifest, stamps & result)
+
+
+proc build_library(path: string; nim_options: seq[string] = @[]; cache_dir = ""): string {.exportpy.} =
+  ## Compile a Nim module to a native shared library in ``cache_dir`` (``~/.cache/nim4py`` if empty), returns its path.
+  ## The library is cached by the hash of the source, the modules it imports from local files and options,
+  ## a cache hit does not run the Nim compiler again, nor read the sources while their size, modification time and inode are unchanged.
+  ## A local miss asks the ``set_remote_cache`` backend first, a fresh build is uploaded to it.
+  ## * ``func build_library(path: string; nim_options: seq[string] = @[]; cache_dir = ""): string``
+  assert path.len > 0, "path must not be empty string"
+  let nim = findExe("nim")
+  if nim.len == 0: raise newException(OSError, "Nim compiler not found on PATH, see https://github.com/juancarlospaco/choosenim_install")
+  let cacheDir = if cache_dir.len > 0: cache_dir else: getHomeDir() / ".cache" / "nim4py"
+  let digest = sourceDigest(path, nim_options, cacheDir)
+  result = cacheDir / (DynlibFormat % (splitFile(path).name & '.' & digest))
+  if not fileExists(result):
+    createDir(cacheDir)
+    let file = pyImport("pathlib").callMethod("Path", result)
+    let key = hostOS & '-' & hostCPU & '/' & extractFilename(result)
+    if remoteCache != nil:
+      let data = remoteCache.callMethod("get", key)
+      if $data.getAttr("__class__").getAttr("__name__") != "NoneType":
+        discard file.callMethod("write_bytes", data)
+        return
+    let command = quoteShellCommand(@[nim, "c", "--app:lib", "-d:release", "--hints:off",
+      "--nimcache:" & cacheDir / digest, "--out:" & result] & nim_options & @[path])
+    let (output, exitCode) = execCmdEx(command)
+    if exitCode != 0: raise newException(OSError, "Nim compilation failed:\n" & output)
+    if remoteCache != nil: discard remoteCache.callMethod("put", key, file.callMethod("read_bytes"))
+
+
+proc sync_environment() {.exportpy.} =
+  ## Read the process environment again on the next ``os.getEnv`` of a script, after Python changed ``os.environ``.
+  ## Every thread reads it again, not only the calling one.
+  ## * ``func sync_environment()``
+  atomicInc environmentChanges
+
+
+proc set_remote_cache(backend: PyObject) {.exportpy.} =
+  ## Share the libraries of ``build_library`` between nodes, ``backend.get(key)`` returns the ``bytes`` or ``None``
+  ## and ``backend.put(key, data)`` stores them, ``key`` is ``"os-cpu/name.digest.so"``. ``None`` removes it.
+  ## * ``func set_remote_cache(backend: object)``
+  remoteCache = if $backend.getAttr("__class__").getAttr("__name__") == "NoneType": nil else: backend
+
+
+proc compile(path: string; nim_options: seq[string] = @[]): PyObject {.exportpy.} =
+  ## Compile a Nim module to a native shared library and load it as ``ctypes.CDLL``, procs must be ``{.exportc, dynlib, cdecl.}``.
+  ## The library is cached by the hash of the source, its local imports and options, a cache hit does not run the Nim compiler again.
+  ## * ``func compile(path: string; nim_options: seq[string] = @[]): ctypes.CDLL``
+  result = pyImport("ctypes").callMethod("CDLL", build_library(path, nim_options))
+
+
+const importHook = """
+import sys, os, importlib.abc, importlib.machinery, importlib.util, nim4py
+class NimFinder(importlib.abc.MetaPathFinder):
+  def find_spec(self, name, path, target = None):
+    for folder in path or sys.path:
+      source = os.path.join(folder or ".", name.rpartition(".")[2] + ".nim")
+      if os.path.isfile(source):
+        library = nim4py.build_library(source, ["--threads:on"], os.path.join(os.path.dirname(os.path.abspath(source)), "__pycache__"))
+        return importlib.util.spec_from_file_location(name, library, loader = importlib.machinery.ExtensionFileLoader(name, library))
+sys.meta_path.append(NimFinder())
+"""
+
+
+proc install_import_hook() {.exportpy.} =
+  ## Let Python ``import mymodule`` load ``mymodule.nim`` from ``sys.path``, procs must be ``{.exportpy.}`` with nimpy.
+  ## It is compiled once into ``__pycache__`` next to the source, and again only when the source or its local imports change.
+  ## * ``func install_import_hook()``
+  var installed {.global.} = false
+  if not installed:
+    discard pyBuiltinsModule().callMethod("exec", importHook, pyBuiltinsModule().callMethod("dict"))
+    installed = true
+
+
+iterator importedFiles(self: Interpreter): tuple[module: PSym; path: string] =
+  ## Modules processed by the Interpreter that come from a file, except the main module.
+  let graph = self.intr.graph
+  for module in graph.modules:
+    if module != nil and sfMainModule notin module.flags:
+      let path = toFullPath(graph.config, FileIndex(module.position))
+      if fileExists(path): yield (module, path)
+
+
+proc fullCollect(self: Interpreter) =
+  ## Full collection of the Nim heap of this thread, holding the GIL because it may free Python objects.
+  let start = epochTime()
+  GC_fullCollect()
+  let pause = epochTime() - start
+  inc self.collections
+  self.pauseTotal += pause
+  self.pauseMax = max(self.pauseMax, pause)
+
+
+proc emitSpans(self: Interpreter) =
+  ## Send the recorded spans to the tracer, once the GIL is held again.
+  if self.tracer != nil:
+    for span in self.spans: discard self.tracer.callObject(span.name, span.start, span.finish)
+  self.spans.setLen 0
+
+
+proc checkMemory(self: Interpreter) =
+  ## Collect when the Nim heap is over ``max_memory``, raise ``MemoryLimitError`` if it still is.
+  if self.maxMemory > 0 and getOccupiedMem() > self.maxMemory:
+    self.fullCollect()
+    if getOccupiedMem() > self.maxMemory:
+      raise newException(MemoryLimitError, "Nim heap over max_memory after a full collection: " & $getOccupiedMem() & " bytes")
+
+
+proc closeLineReaders(self: Interpreter) =
+  ## Close the files of ``openLines`` still open, a script that raised before ``closeLines`` leaves them behind.
+  for file in self.lineReaders.values: close file
+  self.lineReaders.clear()
+
+
+proc forgetRoutines(self: Interpreter) =
+  ## Clear the resolved routines, the handles given so far are rejected by ``invoke`` from now on.
+  self.routines.setLen 0
+  inc self.generation
+
+
+proc evalStream(self: Interpreter; stream: PLLStream = nil) =
+  ## (Re)load the main module, symbols resolved from the previous evaluation are no longer valid.
+  checkInterpreter(self)
+  self.forgetRoutines()
+  self.replSem = nil
+  self.replEval = nil
+  withoutGil(self.releaseGil):
+    withLimits(self):
+      profiled(self, "eval"):
+        reset phaseSeconds
+        phaseNested = 0.0
+        importRecords.setLen 0
+        let start = epochTime()
+        try: self.intr.evalScript(stream)
+        finally:
+          self.imports = move importRecords
+          importStack.setLen 0
+          phaseSeconds[phaseTotal] = epochTime() - start
+          phaseSeconds[phaseParse] = phaseSeconds[phaseTotal] - phaseSeconds[phaseSem] - phaseSeconds[phaseVm]
+          self.phaseTimes = phaseSeconds
+  self.checkMemory()
+  self.emitSpans()
+  if self.hotReload:
+    for _, path in self.importedFiles: self.modified[path] = getLastModificationTime(path)
+
+
+proc callSym(self: Interpreter; routine: PSym; args: seq[PyObject]): PyObject =
+  var nimArgs = newSeqOfCap[PNode](args.len)
+  for i, arg in args: nimArgs.add toNim(arg, if i + 1 < routine.typ.len: routine.typ[i + 1] else: nil)
+  var value: PNode
+  withoutGil(self.releaseGil):
+    withLimits(self):
+      profiled(self, routine.name.s):
+        value = self.intr.callRoutine(routine, nimArgs)
+  self.checkMemory()
+  self.emitSpans()
+  result = toPython(value, routine.typ[0])
+
+
+proc init(self: Interpreter; script: string; nim_stdlib_paths: seq[string]; release_gil = true; hot_reload = false; shared = false; fast = false; hints = false;
+           capabilities = @["fs", "exec", "env"]) {.exportpy.} =
+  ## Create the persistent Interpreter, ``system.nim`` is semantically checked only once here.
+  ## The Python GIL is released while NimScript runs, other Python threads are not blocked.
+  ## ``hot_reload`` tracks the imported files so ``reload`` processes again only the changed ones.
+  ## ``shared`` Interpreters of the same thread and stdlib paths share 1 checked ``system.nim`` and its imported modules,
+  ## each one only adds its own main module, so creating them skips ``compileSystemModule``. They can not ``register``.
+  ## The shared graph is never released, its main modules and their globals stay after ``close``, reuse them with ``reset``.
+  ## ``fast`` skips building hints and warnings (like ``[Processing]`` per imported module), errors are still reported.
+  ## Hints are off unless ``hints``, diagnostics are recorded for ``diagnostics`` instead of printed.
+  ## ``capabilities`` the script may use: ``"fs"`` and ``"exec"`` native helpers, ``"env"`` for ``os.getEnv`` and friends,
+  ## ``"cast"`` for ``cast`` in the VM.
+  ## Pass ``[]`` for untrusted scripts.
+  ## * ``func init(self: Interpreter; script: string; nim_stdlib_paths: seq[string]; release_gil = true; hot_reload = false; shared = false; fast = false; hints = false; capabilities = @["fs", "exec", "env"])``
+  assert script.len > 0, "NimScript must not be empty string"
+  assert nim_stdlib_paths.len > 0, "nim_stdlib_paths must not be empty seq"
+  assert self.intr == nil, "Interpreter is already initialized"
+  for capability in capabilities: assert capability in ["fs", "exec", "env", "cast"], "Unknown capability: " & capability
+  self.releaseGil = release_gil
+  self.hotReload = hot_reload
+  self.owner = getThreadId()
+  let key = nim_stdlib_paths.join("\0") & '\0' & $hot_reload & $fast & $hints & $capabilities
+  withoutGil(release_gil):
+    if shared and key in sharedGraphs:
+      let graph = sharedGraphs[key].graph
+      let path = try: canonicalizePath(graph.config, AbsoluteFile(script)).string except OSError: script
+      let known = graph.config.m.filenameToIndexTbl.getOrDefault(path, FileIndex(-1))
+      graph.config.m.filenameToIndexTbl.del path # A fresh FileIndex, Interpreters of the same script get a module each.
+      let module = graph.makeModule(script)
+      if known.int32 >= 0: graph.config.m.filenameToIndexTbl[path] = known
+      module.flags.incl sfMainModule
+      self.intr = nimeval.Interpreter(mainModule: module, graph: graph, scriptName: script)
+    else:
+      self.intr = createInterpreter(script, resolvePaths(nim_stdlib_paths), if "cast" in capabilities: {allowCast} else: {},
+        proc (config: ConfigRef) = # Before system.nim is checked, so it is checked with these settings too.
+          config.errorMax = high(int)               # Raise errors instead of quitting the Python process.
+          config.globalOptions.excl optUseColors    # Headless, messages never probe or color a terminal.
+          if fast:                                  # Hints and warnings are not even formatted.
+            config.notes = {}
+            config.mainPackageNotes = {}
+            config.foreignPackageNotes = {}
+          else:                                     # Diagnostics have their line and column, no source line is quoted.
+            let excluded = if hints: {hintSource} else: {hintMin .. hintMax}
+            config.notes = config.notes - excluded
+            config.mainPackageNotes = config.mainPackageNotes - excluded
+            config.foreignPackageNotes = config.foreignPackageNotes - excluded)
+      self.intr.graph.suggestMode = hot_reload    # Track module dependencies, needed by isDirty.
+      self.intr.graph.clearPasses()               # Same passes as createInterpreter, timed for ``phases``.
+      self.intr.graph.registerPass(imported(timed(semPass, phaseSem)))
+      self.intr.graph.registerPass(timed(evalPass, phaseVm))
+      self.intr.registerIntrinsics()
+      self.intr.registerBuiltins(capabilities)
+      if shared: sharedGraphs[key] = self.intr
+  self.shared = shared
+
+
+proc register(self: Interpreter; name: string; callback: PyObject) {.exportpy.} =
+  ## Implement the NimScript routine ``name`` (``"module.proc"``) with a Python callable, call it before ``eval``.
+  ## The NimScript declares the routine with a dummy body, like ``proc add*(a, b: int): int = discard``.
+  ## The result is converted to the declared result type, an ``int`` for a ``float`` works, other mismatches raise ``TypeError``.
+  ## The callback must not call nim4py, the Interpreter is still running, that raises ``ValueError``.
+  ## * ``func register(self: Interpreter; name: string; callback: Callable)``
+  checkInterpreter(self)
+  if self.shared: raise newException(ValueError, "register() is not allowed on shared Interpreters, every Interpreter of the graph would get the callback")
+  let parts = name.rsplit('.', maxsplit = 1)
+  assert parts.len == 2 and parts[0].len > 0 and parts[1].len > 0, "name must be module.proc: " & name
+  self.intr.implementRoutine("*", parts[0], parts[1], proc (a: VmArgs) {.closure, gcsafe.} =
+    {.gcsafe.}:
+      withGil:
+        let fn = a.slots[a.rb].node # The called routine, its declared result type guides the conversion.
+        let returnType = (if fn.kind == nkTupleConstr: fn[0].sym else: fn.sym).typ[0]
+        var output: PyObject
+        traced(self, "callback " & name): output = callback.callObject(toPython(a))
+        if returnType == nil: return # The routine returns nothing, the Python result is ignored.
+        let value = toNim(output, returnType)
+        let kind = returnType.skipTypes(skippedTypes).kind
+        if (kind in {tyInt..tyUInt64, tyBool, tyChar, tyEnum}) != (value.kind in {nkCharLit..nkUInt64Lit}) or
+           (kind in {tyFloat..tyFloat128}) != (value.kind in {nkFloatLit..nkFloat128Lit}):
+          raise newException(TypeError, "Python callback for " & name & " returned a " & $value.kind & " for " & typeToString(returnType))
+        case value.kind
+        of nkCharLit..nkUInt64Lit: setResult(a, value.intVal)
+        of nkFloatLit..nkFloat128Lit: setResult(a, value.floatVal)
+        of nkNilLit: discard
+        else: setResult(a, value))
+
+
+proc set_limits(self: Interpreter; max_iterations = 0; timeout = 0.0; max_memory = 0; defer_gc = false) {.exportpy.} =
+  ## Bound each evaluation and call, a runaway script raises ``TimeoutError`` and the Interpreter stays usable.
+  ## ``max_iterations`` counts backward jumps and calls in the VM (``0`` is the Nim default), ``timeout`` is in seconds.
+  ## Over ``max_memory`` bytes of Nim heap after an evaluation runs a full collection, then raises ``MemoryLimitError``.
+  ## ``defer_gc`` never pauses an evaluation to collect, call ``collect`` when idle, ``max_memory`` still applies after it.
+  ## * ``func set_limits(self: Interpreter; max_iterations = 0; timeout = 0.0; max_memory = 0; defer_gc = false)``
+  checkInterpreter(self)
+  assert max_iterations >= 0, "max_iterations must be a positive integer or 0"
+  assert timeout >= 0.0, "timeout must be a positive float or 0.0"
+  assert max_memory >= 0, "max_memory must be a positive integer or 0"
+  self.maxIterations = max_iterations
+  self.timeout = timeout
+  self.maxMemory = max_memory
+  self.deferGc = defer_gc
+
+
+proc memory(self: Interpreter): PyObject {.exportpy.} =
+  ## Nim heap statistics as a ``dict``, the heap is per thread so it covers the Interpreters of the calling thread.
+  ## * ``func memory(self: Interpreter): dict``
+  checkInterpreter(self)
+  result = pyBuiltinsModule().callMethod("dict")
+  discard result.callMethod("__setitem__", "total", getTotalMem())
+  discard result.callMethod("__setitem__", "occupied", getOccupiedMem())
+  discard result.callMethod("__setitem__", "free", getFreeMem())
+  discard result.callMethod("__setitem__", "collections", self.collections)
+  discard result.callMethod("__setitem__", "pause_total", self.pauseTotal)
+  discard result.callMethod("__setitem__", "pause_max", self.pauseMax)
+  discard result.callMethod("__setitem__", "gc", GC_getStatistics())
+
+
+proc measure(n: PNode; nodes, bytes: var int) =
+  ## Count the nodes of the VM value ``n`` and the bytes of its strings.
+  if n == nil: return
+  inc nodes
+  case n.kind
+  of nkStrLit..nkTripleStrLit: bytes += n.strVal.len
+  of nkCharLit..nkUInt64Lit, nkFloatLit..nkFloat128Lit, nkSym, nkIdent, nkEmpty, nkNilLit, nkType: discard
+  else:
+    for child in n: measure(child, nodes, bytes)
+
+
+proc heap_snapshot(self: Interpreter): PyObject {.exportpy.} =
+  ## What this Interpreter keeps alive on the Nim heap, as a ``dict``: VM code, constants, types, callbacks and modules,
+  ## ``globals`` nodes and string bytes, and each exported global by ``module.name``. Diff 2 snapshots to find growth.
+  ## * ``func heap_snapshot(self: Interpreter): dict``
+  checkInterpreter(self)
+  let py = pyBuiltinsModule()
+  let vm = PCtx(self.intr.graph.vm)
+  result = py.callMethod("dict")
+  discard result.callMethod("__setitem__", "occupied", getOccupiedMem())
+  discard result.callMethod("__setitem__", "code", vm.code.len)
+  discard result.callMethod("__setitem__", "constants", vm.constants.len)
+  discard result.callMethod("__setitem__", "types", vm.types.len)
+  discard result.callMethod("__setitem__", "callbacks", vm.callbacks.len)
+  var modules, nodes, bytes = 0
+  for module in self.intr.graph.modules:
+    if module != nil: inc modules
+  measure(vm.globals, nodes, bytes)
+  discard result.callMethod("__setitem__", "modules", modules)
+  discard result.callMethod("__setitem__", "globals", nodes)
+  discard result.callMethod("__setitem__", "globals_bytes", bytes)
+  let exported = py.callMethod("dict")
+  for module in self.intr.graph.modules:
+    if module == nil: continue
+    var it: TTabIter
+    var symbol = initTabIter(it, module.tab)
+    while symbol != nil:
+      if symbol.kind in {skVar, skLet} and sfGlobal in symbol.flags and symbol.position > 0 and symbol.position <= vm.globals.len:
+        var globalNodes, globalBytes = 0
+        measure(vm.globals[symbol.position - 1], globalNodes, globalBytes)
+        discard exported.callMethod("__setitem__", module.name.s & '.' & symbol.name.s, @[globalNodes, globalBytes])
+      symbol = nextIter(it, module.tab)
+  discard result.callMethod("__setitem__", "exported", exported)
+
+
+proc collect(self: Interpreter): int {.exportpy.} =
+  ## Run a full collection of the Nim heap now, returns the bytes freed.
+  ## * ``func collect(self: Interpreter): int``
+  checkInterpreter(self)
+  let before = getOccupiedMem()
+  self.fullCollect()
+  result = before - getOccupiedMem()
+
+
+proc diagnostics(self: Interpreter): PyObject {.exportpy.} =
+  ## Hints, warnings and errors of the last evaluation as a ``list`` of ``dict``, then cleared.
+  ## * ``func diagnostics(self: Interpreter): list``
+  checkInterpreter(self)
+  let py = pyBuiltinsModule()
+  result = py.callMethod("list")
+  for entry in self.messages:
+    let diagnostic = py.callMethod("dict")
+    discard diagnostic.callMethod("__setitem__", "file", toFullPath(self.intr.graph.config, entry.info.fileIndex))
+    discard diagnostic.callMethod("__setitem__", "line", int(entry.info.line))
+    discard diagnostic.callMethod("__setitem__", "column", int(entry.info.col) + 1)
+    discard diagnostic.callMethod("__setitem__", "severity", $entry.severity)
+    discard diagnostic.callMethod("__setitem__", "message", entry.message)
+    discard result.callMethod("append", diagnostic)
+  self.messages.setLen 0
+
+
+proc capture_output(self: Interpreter; enabled: bool) {.exportpy.} =
+  ## Collect ``echo`` in memory, read it with ``read_output``, no write per line. Compiler messages go to ``diagnostics``.
+  ## * ``func capture_output(self: Interpreter; enabled: bool)``
+  checkInterpreter(self)
+  self.captureOutput = enabled
+
+
+proc read_output(self: Interpreter): string {.exportpy.} =
+  ## Return the captured output since the last call and clear it.
+  ## * ``func read_output(self: Interpreter): string``
+  checkInterpreter(self)
+  result = move self.output
+
+
+proc set_profiling(self: Interpreter; enabled: bool) {.exportpy.} =
+  ## Start or stop recording the time of each evaluation and call, starting clears the previous profile.
+  ## * ``func set_profiling(self: Interpreter; enabled: bool)``
+  checkInterpreter(self)
+  if enabled and not self.profiling: self.samples.clear()
+  self.profiling = enabled
+
+
+proc set_tracer(self: Interpreter; tracer: PyObject) {.exportpy.} =
+  ## Attach a callable getting a span ``(name, start_ns, end_ns)`` in Unix nanoseconds for each evaluation,
+  ## routine called from Python and Python callback, after it ends. ``None`` detaches it.
+  ## * ``func set_tracer(self: Interpreter; tracer: Callable)``
+  checkInterpreter(self)
+  self.tracer = if $tracer.getAttr("__class__").getAttr("__name__") == "NoneType": nil else: tracer
+  self.spans.setLen 0
+
+
+proc profile(self: Interpreter): string {.exportpy.} =
+  ## Profile as collapsed stacks in microseconds, 1 ``script;routine microseconds`` per line, for ``flamegraph.pl``.
+  ## * ``func profile(self: Interpreter): string``
+  checkInterpreter(self)
+  for stack, seconds in self.samples: result.add stack & ' ' & $int(seconds * 1_000_000) & '\n'
+
+
+proc phases(self: Interpreter): PyObject {.exportpy.} =
+  ## Seconds spent per compiler phase by the last evaluation, as a ``dict`` with keys ``parse``, ``sem``, ``vm`` and ``total``.
+  ## ``sem`` includes ``transf`` of the checked code, ``vm`` is code generation plus execution of each top-level statement.
+  ## * ``func phases(self: Interpreter): dict``
+  checkInterpreter(self)
+  result = pyBuiltinsModule().callMethod("dict")
+  for phase, seconds in self.phaseTimes: discard result.callMethod("__setitem__", $phase, seconds)
+
+
+proc import_profile(self: Interpreter): PyObject {.exportpy.} =
+  ## Modules processed by the last evaluation, like ``python -X importtime``, as a ``list`` of ``dict``
+  ## with ``module``, ``self`` and ``cumulative`` seconds and the Nim heap ``memory`` bytes it grew, in the order they finished.
+  ## Modules already processed by an earlier evaluation or a shared graph are not processed again, so they are not listed.
+  ## * ``func import_profile(self: Interpreter): list``
+  checkInterpreter(self)
+  let py = pyBuiltinsModule()
+  result = py.callMethod("list")
+  for record in self.imports:
+    let entry = py.callMethod("dict")
+    discard entry.callMethod("__setitem__", "module", record.module)
+    discard entry.callMethod("__setitem__", "self", record.self)
+    discard entry.callMethod("__setitem__", "cumulative", record.cumulative)
+    discard entry.callMethod("__setitem__", "memory", record.memory)
+    discard result.callMethod("append", entry)
+
+
+proc eval(self: Interpreter) {.exportpy.} =
+  ## Run (or re-run) the NimScript given to ``init`` on the same Interpreter.
+  ## * ``func eval(self: Interpreter)``
+  self.evalStream()
+
+
+proc reload(self: Interpreter): seq[string] {.exportpy.} =
+  ## Re-run the NimScript given to ``init``, only the imported modules whose files changed since the last evaluation
+  ## and the modules importing them are processed again. Returns the changed files.
+  ## * ``func reload(self: Interpreter): seq[string]``
+  checkInterpreter(self)
+  assert self.hotReload, "Interpreter must be initialized with hot_reload=True"
+  for module, path in self.importedFiles:
+    if getLastModificationTime(path) != self.modified.getOrDefault(path):
+      result.add path
+      module.flags.incl sfDirty
+      self.intr.graph.markClientsDirty(FileIndex(module.position))
+  self.evalStream()
+
+
+proc reset(self: Interpreter) {.exportpy.} =
+  ## Forget the state of the last request: main module symbols, routine handles, captured output and diagnostics.
+  ## ``system``, the stdlib, the ``IdentCache`` and the registered callbacks are kept, the next eval starts clean.
+  ## Files left open by ``openLines`` are closed.
+  ## With ``hot_reload`` the imported modules outside the stdlib paths are processed again too, with fresh globals.
+  ## The profile is cleared too. The VM global slots of the script stay allocated, bytecode of other modules may index
+  ## slots after them (``{.global.}`` vars of a proc generated on its first call), ``heap_snapshot`` shows their size.
+  ## * ``func reset(self: Interpreter)``
+  checkInterpreter(self)
+  self.samples.clear()
+  self.spans.setLen 0
+  self.imports.setLen 0
+  initStrTable(self.intr.mainModule.tab)
+  self.intr.mainModule.ast = nil
+  self.forgetRoutines()
+  self.replSem = nil
+  self.replEval = nil
+  self.output.setLen 0
+  self.messages.setLen 0
+  self.closeLineReaders()
+  if self.hotReload:
+    for module, path in self.importedFiles:
+      var isStdlib = false
+      for folder in self.intr.graph.config.searchPaths: isStdlib = isStdlib or path.startsWith(folder.string)
+      if not isStdlib:
+        module.flags.incl sfDirty
+        self.intr.graph.markClientsDirty(FileIndex(module.position))
+
+
+proc eval_file(self: Interpreter; script: string) {.exportpy.} =
+  ## Run another NimScript file on the same Interpreter, reusing the already checked ``system.nim``.
+  ## * ``func eval_file(self: Interpreter; script: string)``
+  checkInterpreter(self)
+  assert script.len > 0, "NimScript must not be empty string"
+  self.evalStream(llStreamOpen(readFile(script))) # 1 read, the lexer refills its buffer from memory.
+
+
+proc eval_string(self: Interpreter; source: string) {.exportpy.} =
+  ## Run NimScript source code from an in-memory string, without touching the filesystem.
+  ## * ``func eval_string(self: Interpreter; source: string)``
+  assert source.len > 0, "NimScript must not be empty string"
+  self.evalStream(llStreamOpen(source))
+
+
+proc precompile(self: Interpreter; paths: seq[string]) {.exportpy.} =
+  ## Parse, check and run the top-level code of the modules at ``paths`` now, with the GIL released,
+  ## a later ``import`` of them in a script reuses the processed modules and only its own code remains.
+  ## Other Python threads keep running meanwhile, so it hides behind their network waits.
+  ## * ``func precompile(self: Interpreter; paths: seq[string])``
+  checkInterpreter(self)
+  withoutGil(self.releaseGil):
+    withLimits(self):
+      profiled(self, "precompile"):
+        for path in paths:
+          let fileIdx = fileInfoIdx(self.intr.graph.config, AbsoluteFile(absolutePath(path)))
+          if self.intr.graph.getModule(fileIdx) == nil: discard self.intr.graph.compileModule(fileIdx, {})
+  self.checkMemory()
+  self.emitSpans()
+
+
+proc exec(self: Interpreter; source: string) {.exportpy.} =
+  ## Run statements in the scope the previous ``exec`` calls left, like a REPL or notebook cell.
+  ## Only ``source`` is parsed, checked and run, the symbols and globals of earlier cells are kept.
+  ## ``eval``, ``eval_string``, ``eval_file`` and ``reset`` start a new scope.
+  ## * ``func exec(self: Interpreter; source: string)``
+  checkInterpreter(self)
+  assert source.len > 0, "NimScript must not be empty string"
+  self.forgetRoutines() # Names exported by the cell may shadow the resolved routines.
+  withoutGil(self.releaseGil):
+    withLimits(self):
+      profiled(self, "exec"):
+        let graph = self.intr.graph
+        if self.replSem == nil: # The passes stay open, closing them finishes the module.
+          self.replSem = semPass.open(graph, self.intr.mainModule)
+          self.replEval = evalPass.open(graph, self.intr.mainModule)
+        for statement in parseString(source, graph.cache, graph.config, self.intr.scriptName):
+          let checked = semPass.process(self.replSem, statement)
+          if checked != nil: discard evalPass.process(self.replEval, checked)
+  self.checkMemory()
+  self.emitSpans()
+
+
+proc call(self: Interpreter; name: string; args: seq[PyObject] = @[]): PyObject {.exportpy.} =
+  ## Call an exported ``*`` top-level routine of the loaded NimScript, returns the result as a Python object.
+  ## * ``func call(self: Interpreter; name: string; args: seq[PyObject] = @[]): PyObject``
+  checkInterpreter(self)
+  let routine = self.intr.selectRoutine(name)
+  if routine == nil: raise newException(KeyError, "NimScript routine not found or overloaded, it must be exported with *: " & name)
+  result = self.callSym(routine, args)
+
+
+proc stream(self: Interpreter; name: string; args: seq[PyObject]; consumer: PyObject): PyObject {.exportpy.} =
+  ## Call the routine ``name``, each ``pyYield(value)`` it runs calls ``consumer(value)`` right away,
+  ## so big results are consumed 1 by 1 instead of building a whole ``seq`` first. Returns the routine result.
+  ## * ``func stream(self: Interpreter; name: string; args: seq[PyObject]; consumer: Callable): PyObject``
+  let previous = streamConsumer
+  streamConsumer = consumer
+  try: result = self.call(name, args)
+  finally: streamConsumer = previous
+
+
+proc routine(self: Interpreter; name: string): int {.exportpy.} =
+  ## Resolve an exported ``*`` routine once, returns a handle for ``invoke`` valid until the next eval.
+  ## * ``func routine(self: Interpreter; name: string): int``
+  checkInterpreter(self)
+  let routine = self.intr.selectRoutine(name)
+  if routine == nil: raise newException(KeyError, "NimScript routine not found or overloaded, it must be exported with *: " & name)
+  result = self.generation shl 32 or self.routines.len
+  self.routines.add routine
+
+
+proc invoke(self: Interpreter; handle: int; args: seq[PyObject] = @[]): PyObject {.exportpy.} =
+  ## Call a routine by handle, skips the symbol lookup and reuses the bytecode generated on the first call.
+  ## * ``func invoke(self: Interpreter; handle: int; args: seq[PyObject] = @[]): PyObject``
+  checkInterpreter(self)
+  let index = handle and 0xFFFF_FFFF
+  if handle < 0 or handle shr 32 != self.generation or index >= self.routines.len:
+    raise newException(IndexError, "Invalid or stale routine handle, get a new one with routine() after eval: " & $handle)
+  result = self.callSym(self.routines[index], args)
+
+
+proc map(self: Interpreter; name: string; args: seq[seq[PyObject]]): PyObject {.exportpy.} =
+  ## Call the routine ``name`` once per item of ``args`` (a list of arguments per call), returns a list of the results.
+  ## The routine is resolved, the GIL released and the limits set once per batch, not once per call.
+  ## * ``func map(self: Interpreter; name: string; args: seq[seq[PyObject]]): list``
+  checkInterpreter(self)
+  let routine = self.intr.selectRoutine(name)
+  if routine == nil: raise newException(KeyError, "NimScript routine not found or overloaded, it must be exported with *: " & name)
+  var calls = newSeqOfCap[seq[PNode]](args.len)
+  for arguments in args:
+    var nimArgs = newSeqOfCap[PNode](arguments.len)
+    for i, arg in arguments: nimArgs.add toNim(arg, if i + 1 < routine.typ.len: routine.typ[i + 1] else: nil)
+    calls.add nimArgs
+  var values = newSeqOfCap[PNode](calls.len)
+  withoutGil(self.releaseGil):
+    withLimits(self):
+      profiled(self, routine.name.s):
+        for nimArgs in calls: values.add self.intr.callRoutine(routine, nimArgs)
+  self.checkMemory()
+  self.emitSpans()
+  result = pyBuiltinsModule().callMethod("list")
+  for value in values: discard result.callMethod("append", toPython(value, routine.typ[0]))
+
+
+proc get_global(self: Interpreter; name: string): PyObject {.exportpy.} =
+  ## Read an exported ``*`` top-level ``let`` or ``var`` of the loaded NimScript as a Python object.
+  ## * ``func get_global(self: Interpreter; name: string): PyObject``
+  checkInterpreter(self)
+  let variable = self.intr.selectUniqueSymbol(name)
+  if variable == nil: raise newException(KeyError, "NimScript global not found or ambiguous, it must be exported with *: " & name)
+  result = toPython(self.intr.getGlobalValue(variable), variable.typ)
+
+
+proc sameLayout(a, b: PType; seen: var seq[tuple[a, b: int]]): bool
+
+
+proc sameLayout(a, b: PNode; seen: var seq[tuple[a, b: int]]): bool =
+  ## Same fields, ranges and enum values, by name and type, for the ``n`` of 2 types.
+  if a == nil or b == nil: return a == b
+  if a.kind != b.kind or a.len != b.len: return false
+  case a.kind
+  of nkCharLit..nkUInt64Lit: result = a.intVal == b.intVal
+  of nkFloatLit..nkFloat128Lit: result = a.floatVal == b.floatVal
+  of nkStrLit..nkTripleStrLit: result = a.strVal == b.strVal
+  of nkSym: result = a.sym.name.s == b.sym.name.s and a.sym.position == b.sym.position and sameLayout(a.sym.typ, b.sym.typ, seen)
+  of nkIdent: result = a.ident.s == b.ident.s
+  else:
+    for i in 0 ..< a.len:
+      if not sameLayout(a[i], b[i], seen): return false
+    result = true
+
+
+proc sameLayout(a, b: PType; seen: var seq[tuple[a, b: int]]): bool =
+  ## ``a`` and ``b`` of 2 graphs are the same type field by field, kind by kind, recursively, not only by name.
+  ## 2 scripts declaring ``Config`` with other fields are different, the VM would read the wrong kind of field.
+  if a == nil or b == nil: return a == b
+  if (a.id, b.id) in seen: return true # Recursive type, equal unless some other part of it differs.
+  seen.add (a.id, b.id)
+  if a.kind != b.kind or a.len != b.len or a.flags * {tfUnion, tfPacked} != b.flags * {tfUnion, tfPacked}: return false
+  for i in 0 ..< a.len:
+    if not sameLayout(a[i], b[i], seen): return false
+  result = sameLayout(a.n, b.n, seen)
+
+
+proc transfer(self: Interpreter; target: Interpreter; name: string; target_name = "") {.exportpy.} =
+  ## Copy the exported ``*`` global ``name`` into the global ``target_name`` (``name`` if empty) of ``target``,
+  ## as a deep copy of the VM value, without converting it to Python or JSON. Both must be of this thread.
+  ## Both globals must have the same type structurally, same fields with the same types, ``TypeError`` otherwise.
+  ## * ``func transfer(self: Interpreter; target: Interpreter; name: string; target_name = "")``
+  checkInterpreter(self)
+  checkInterpreter(target)
+  let source = self.intr.selectUniqueSymbol(name)
+  if source == nil: raise newException(KeyError, "NimScript global not found or ambiguous, it must be exported with *: " & name)
+  let destination = target.intr.selectUniqueSymbol(if target_name.len > 0: target_name else: name, {skVar})
+  if destination == nil: raise newException(KeyError, "Target global not found or ambiguous, it must be an exported var: " & (if target_name.len > 0: target_name else: name))
+  var seen: seq[tuple[a, b: int]]
+  if not sameLayout(source.typ, destination.typ, seen):
+    raise newException(TypeError, "Globals have different types: " & typeToString(source.typ) & " and " & typeToString(destination.typ))
+  PCtx(target.intr.graph.vm).setGlobalValue(destination, copyTree(self.intr.getGlobalValue(source)))
+
+
+proc async_worker(id: int; action: string; args: seq[PyObject]): PyObject {.exportpy.} =
+  ## Runs on the background thread of ``*_async`` methods, the Interpreter is created and used only there.
+  ## * ``func async_worker(id: int; action: string; args: seq[PyObject]): PyObject``
+  result = pyBuiltinsModule().getAttr("None")
+  case action
+  of "init":
+    let interpreter = Interpreter()
+    interpreter.init(args[0].to(string), args[1].to(seq[string]))
+    asyncWorkers[id] = interpreter
+  of "eval": asyncWorkers[id].eval_string(args[0].to(string))
+  of "call": result = asyncWorkers[id].call(args[0].to(string), args[1].to(seq[PyObject]))
+  of "close":
+    asyncWorkers[id].close()
+    asyncWorkers.del id
+  else: raise newException(ValueError, "Unknown async_worker action: " & action)
+
+
+proc runAsync(self: Interpreter; action: string; args: varargs[PyObject]): PyObject =
+  ## Schedule ``action`` on the background thread, returns an ``asyncio`` future.
+  assert self.executor != nil, "Interpreter is not initialized, call init_async() first"
+  result = pyImport("asyncio").callMethod("get_event_loop").callMethod("run_in_executor",
+    self.executor, pyImport("nim4py").getAttr("async_worker"), self.asyncId, action, @args)
+
+
+proc init_async(self: Interpreter; script: string; nim_stdlib_paths: seq[string]): PyObject {.exportpy.} =
+  ## Like ``init`` but on a background thread, returns an awaitable. Use only ``*_async`` methods and ``close`` afterwards.
+  ## * ``func init_async(self: Interpreter; script: string; nim_stdlib_paths: seq[string]): Awaitable``
+  assert script.len > 0, "NimScript must not be empty string"
+  assert nim_stdlib_paths.len > 0, "nim_stdlib_paths must not be empty seq"
+  assert self.intr == nil and self.executor == nil, "Interpreter is already initialized"
+  inc asyncCounter
+  self.asyncId = asyncCounter
+  self.executor = pyImport("concurrent.futures").callMethod("ThreadPoolExecutor", 1)
+  let py = pyBuiltinsModule()
+  result = self.runAsync("init", py.callMethod("str", script), py.callMethod("list", nim_stdlib_paths))
+
+
+proc eval_async(self: Interpreter; source: string): PyObject {.exportpy.} =
+  ## Like ``eval_string`` but does not block the ``asyncio`` event loop, returns an awaitable.
+  ## * ``func eval_async(self: Interpreter; source: string): Awaitable``
+  assert source.len > 0, "NimScript must not be empty string"
+  result = self.runAsync("eval", pyBuiltinsModule().callMethod("str", source))
+
+
+proc call_async(self: Interpreter; name: string; args: seq[PyObject] = @[]): PyObject {.exportpy.} =
+  ## Like ``call`` but does not block the ``asyncio`` event loop, returns an awaitable.
+  ## * ``func call_async(self: Interpreter; name: string; args: seq[PyObject] = @[]): Awaitable``
+  let py = pyBuiltinsModule()
+  result = self.runAsync("call", py.callMethod("str", name), py.callMethod("list", args))
+
+
+proc close(self: Interpreter) {.exportpy.} =
+  ## Destroy the Interpreter, it can be initialized again with ``init``.
+  ## * ``func close(self: Interpreter)``
+  if self.executor != nil:
+    discard self.executor.callMethod("submit", pyImport("nim4py").getAttr("async_worker"), self.asyncId, "close", newSeq[PyObject]()).callMethod("result")
+    discard self.executor.callMethod("shutdown")
+    self.executor = nil
+  if self.intr != nil:
+    self.intr.destroyInterpreter()
+    self.intr = nil
+    self.forgetRoutines()
+    self.replSem = nil
+    self.replEval = nil
+    self.modified.clear()
+    self.samples.clear()
+    self.spans.setLen 0
+    self.tracer = nil
+    self.output.setLen 0
+    self.messages.setLen 0
+    self.closeLineReaders()
+
+
+proc pool_worker_init(script: string; nim_stdlib_paths: seq[string]) {.exportpy.} =
+  ## Initializer of ``Pool`` worker processes, the NimScript is loaded once per process.
+  ## * ``func pool_worker_init(script: string; nim_stdlib_paths: seq[string])``
+  worker = Interpreter()
+  worker.init(script, nim_stdlib_paths)
+  worker.eval()
+
+
+proc pool_worker_call(name: string; args: seq[PyObject]): PyObject {.exportpy.} =
+  ## Call a routine on the warm Interpreter of a ``Pool`` worker process.
+  ## * ``func pool_worker_call(name: string; args: seq[PyObject]): PyObject``
+  assert worker != nil, "pool_worker_call() must run inside a Pool worker process"
+  result = worker.call(name, args)
+
+
+proc init(self: Pool; script: string; nim_stdlib_paths: seq[string]; processes = 0) {.exportpy.} =
+  ## Start ``processes`` worker processes (all CPU cores if ``0``), each one loads the NimScript once.
+  ## * ``func init(self: Pool; script: string; nim_stdlib_paths: seq[string]; processes = 0)``
+  assert script.len > 0, "NimScript must not be empty string"
+  assert nim_stdlib_paths.len > 0, "nim_stdlib_paths must not be empty seq"
+  assert processes >= 0, "processes must be a positive integer or 0"
+  assert self.pool == nil, "Pool is already initialized"
+  let py = pyBuiltinsModule()
+  let initargs = py.callMethod("list")
+  discard initargs.callMethod("append", script)
+  discard initargs.callMethod("append", nim_stdlib_paths)
+  let workers = if processes > 0: py.callMethod("int", processes) else: py.getAttr("None")
+  self.pool = pyImport("multiprocessing").callMethod("Pool", workers, pyImport("nim4py").getAttr("pool_worker_init"), py.callMethod("tuple", initargs))
+
+
+proc map(self: Pool; name: string; args: seq[PyObject]): PyObject {.exportpy.} =
+  ## Call the routine ``name`` once per item of ``args`` (a list of arguments per call) across the workers.
+  ## * ``func map(self: Pool; name: string; args: seq[PyObject]): PyObject``
+  assert self.pool != nil, "Pool is not initialized, call init() first"
+  let py = pyBuiltinsModule()
+  let calls = py.callMethod("list")
+  for arguments in args:
+    let call = py.callMethod("list")
+    discard call.callMethod("append", name)
+    discard call.callMethod("append", arguments)
+    discard calls.callMethod("append", py.callMethod("tuple", call))
+  result = self.pool.callMethod("starmap", pyImport("nim4py").getAttr("pool_worker_call"), calls)
+
+
+proc close(self: Pool) {.exportpy.} =
+  ## Stop the worker processes.
+  ## * ``func close(self: Pool)``
+  if self.pool != nil:
+    discard self.pool.callMethod("close")
+    discard self.pool.callMethod("join")
+    self.pool = nil
+
+
+proc init(self: ForkServer; script: string; nim_stdlib_paths: seq[string]) {.exportpy.} =
+  ## Warm 1 Interpreter in this process, ``system.nim`` and the imports of ``script`` are checked once here. POSIX only.
+  ## * ``func init(self: ForkServer; script: string; nim_stdlib_paths: seq[string])``
+  assert self.interpreter == nil, "ForkServer is already initialized"
+  self.interpreter = Interpreter()
+  self.interpreter.init(script, nim_stdlib_paths)
+  self.interpreter.eval()
+
+
+proc call(self: ForkServer; name: string; args: seq[PyObject] = @[]): PyObject {.exportpy.} =
+  ## Call the routine ``name`` in a forked child, it starts from the warm state and its changes are thrown away.
+  ## The result comes back pickled over a pipe, an error in the child raises ``RequestError``.
+  ## The fork waits for ``nimLock``, so a child never starts with another thread halfway inside the Nim compiler.
+  ## * ``func call(self: ForkServer; name: string; args: seq[PyObject] = @[]): PyObject``
+  assert self.interpreter != nil, "ForkServer is not initialized, call init() first"
+  let py = pyBuiltinsModule()
+  let os = pyImport("os")
+  let pickle = pyImport("pickle")
+  checkReentry()
+  let fds = py.callMethod("list", os.callMethod("pipe")).to(seq[int])
+  let state = if pyEvalSaveThread != nil and pyEvalRestoreThread != nil: pyEvalSaveThread() else: nil
+  acquire nimLock # Without the GIL, like withoutGil, a thread holding nimLock may be waiting for it.
+  if state != nil: pyEvalRestoreThread(state)
+  var pid: int
+  try: pid = os.callMethod("fork").to(int)
+  finally: release nimLock # Parent and child each release their own copy, the child has no other thread.
+  if pid == 0: # Child, never returns.
+    var code = 1
+    try:
+      let response = py.callMethod("list")
+      try:
+        let value = self.interpreter.call(name, args)
+        discard response.callMethod("append", true)
+        discard response.callMethod("append", value)
+      except:
+        discard response.callMethod("clear")
+        discard response.callMethod("append", false)
+        discard response.callMethod("append", getCurrentExceptionMsg())
+      let output = os.callMethod("fdopen", fds[1], "wb")
+      discard output.callMethod("write", pickle.callMethod("dumps", response))
+      discard output.callMethod("close")
+      code = 0
+    finally: discard os.callMethod("_exit", code) # Whatever failed, the child never runs the code of the parent.
+  discard os.callMethod("close", fds[1])
+  let input = os.callMethod("fdopen", fds[0], "rb")
+  let payload = input.callMethod("read")
+  discard input.callMethod("close")
+  discard os.callMethod("waitpid", pid, 0)
+  if py.callMethod("len", payload).to(int) == 0: raise newException(RequestError, "ForkServer child process died: " & name)
+  let response = pickle.callMethod("loads", payload).to(seq[PyObject])
+  if not response[0].to(bool): raise newException(RequestError, response[1].to(string))
+  result = response[1]
+
+
+proc close(self: ForkServer) {.exportpy.} =
+  ## Destroy the warm Interpreter.
+  ## * ``func close(self: ForkServer)``
+  if self.interpreter != nil:
+    self.interpreter.close()
+    self.interpreter = nil
+
+
+proc init(self: Channel; capacity = 1 shl 20) {.exportpy.} =
+  ## Allocate 2 rings of ``capacity`` bytes in shared memory, to the NimScript and from it.
+  ## Messages cross as bytes, without the GIL or the Nim heap of either side.
+  ## * ``func init(self: Channel; capacity = 1 shl 20)``
+  assert capacity > sizeof(int), "capacity must be bigger than " & $sizeof(int)
+  assert self.id == 0, "Channel is already initialized"
+  withLock channelLock:
+    for id in 1 .. channels.high:
+      let channel = addr channels[id]
+      if atomicLoadN(addr channel.users, ATOMIC_ACQUIRE) == 0 and channel.inbox.data == nil: # Free and its rings freed.
+        channel.inbox = Ring(size: capacity, data: cast[ptr UncheckedArray[char]](allocShared0(capacity)))
+        channel.outbox = Ring(size: capacity, data: cast[ptr UncheckedArray[char]](allocShared0(capacity)))
+        atomicStoreN(addr channel.closed, false, ATOMIC_RELAXED)
+        atomicStoreN(addr channel.users, 1, ATOMIC_RELEASE) # Published, ``acquireChannel`` takes it from now on.
+        self.id = id
+        return
+  raise newException(ValueError, "Too many open Channel: " & $channels.high)
+
+
+proc id(self: Channel): int {.exportpy.} =
+  ## Number to pass to the NimScript, for ``channelSend`` and ``channelRecv``.
+  ## * ``func id(self: Channel): int``
+  assert self.id > 0, "Channel is not initialized, call init() first"
+  result = self.id
+
+
+proc send(self: Channel; message: string) {.exportpy.} =
+  ## Send ``message`` to ``channelRecv`` of the NimScript, waits without the GIL while the ring is full.
+  ## Only 1 Python thread may send on a Channel.
+  ## * ``func send(self: Channel; message: string)``
+  assert self.id > 0, "Channel is not initialized, call init() first"
+  let channel = acquireChannel(self.id)
+  if channel == nil: raise newException(ValueError, "Channel is closed: " & $self.id)
+  try:
+    waitFor(channel.inbox.push(message)):
+      if atomicLoadN(addr channel.closed, ATOMIC_ACQUIRE): raise newException(ValueError, "Channel is closed: " & $self.id)
+      let state = if pyEvalSaveThread != nil: pyEvalSaveThread() else: nil
+      os.sleep 1
+      if state != nil: pyEvalRestoreThread(state)
+  finally: releaseChannel(channel)
+
+
+proc recv(self: Channel; timeout = -1.0): PyObject {.exportpy.} =
+  ## Next message of ``channelSend`` of the NimScript as ``str``, ``None`` after ``timeout`` seconds (``-1`` waits forever).
+  ## Only 1 Python thread may receive on a Channel.
+  ## * ``func recv(self: Channel; timeout = -1.0): PyObject``
+  assert self.id > 0, "Channel is not initialized, call init() first"
+  let channel = acquireChannel(self.id)
+  if channel == nil: raise newException(ValueError, "Channel is closed: " & $self.id)
+  let deadline = if timeout < 0: Inf else: epochTime() + timeout
+  var message: string
+  var expired = false
+  try:
+    waitFor(expired or channel.outbox.pop(message)):
+      if atomicLoadN(addr channel.closed, ATOMIC_ACQUIRE): raise newException(ValueError, "Channel is closed: " & $self.id)
+      if epochTime() >= deadline: expired = true
+      else:
+        let state = if pyEvalSaveThread != nil: pyEvalSaveThread() else: nil
+        os.sleep 1
+        if state != nil: pyEvalRestoreThread(state)
+  finally: releaseChannel(channel)
+  result = if expired: pyBuiltinsModule().getAttr("None") else: pyBuiltinsModule().callMethod("str", message)
+
+
+proc close(self: Channel) {.exportpy.} =
+  ## Free the shared memory once no send or receive runs on it, a NimScript blocked on the Channel raises.
+  ## * ``func close(self: Channel)``
+  if self.id > 0:
+    let channel = addr channels[self.id]
+    atomicStoreN(addr channel.closed, true, ATOMIC_RELEASE) # ``acquireChannel`` gives ``nil`` from now on.
+    releaseChannel(channel)
+    self.id = 0